@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/*
+ * Transport benchmark for the two-process pattern of main.c.
+ * Parent and child exchange messages over every transport and the
+ * results are printed as CSV: throughput of a one way stream and
+ * round trip latency percentiles of a ping-pong, for each message size.
+ */
+
+#define BENCH_FIFO1 "/tmp/benchfifo1"
+#define BENCH_FIFO2 "/tmp/benchfifo2"
+#define BENCH_SHM "/ipcbench_ring"
+#define RING_SIZE (1 << 20) // Bytes in each shared memory ring
+#define STREAM_BYTES (64L << 20) // Bytes sent in one throughput run
+#define MAX_MESSAGES 200000 // Upper limit of messages in one throughput run
+#define MAX_PINGS 2000 // Upper limit of round trips in one latency run
+
+// Single producer single consumer ring in shared memory, one per direction
+typedef struct {
+    _Atomic size_t head; // Bytes written so far
+    _Atomic size_t tail; // Bytes read so far
+    char data[RING_SIZE];
+} shmRing;
+
+// Both directions of a transport, 0 is parent to child and 1 is child to parent
+typedef struct {
+    int fd[2][2]; // Read and write descriptor of each direction
+    shmRing *ring[2]; // Rings of the shm transport
+    int memFd; // Splice target of the splice transport
+} channel;
+
+typedef struct {
+    const char *name;
+    int (*open)(channel *ch);
+    int (*send)(channel *ch, int dir, const char *buf, size_t size);
+    int (*recv)(channel *ch, int dir, char *buf, size_t size);
+    void (*close)(channel *ch);
+} transport;
+
+static const size_t messageSizes[] = {64, 512, 4096, 32768, 262144, 1048576};
+
+/* Write the whole buffer, returns -1 on error */
+static int fdSend(channel *ch, int dir, const char *buf, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = write(ch->fd[dir][1], buf + done, size - done);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* Read the whole buffer, returns -1 on error or end of file */
+static int fdRecv(channel *ch, int dir, char *buf, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = read(ch->fd[dir][0], buf + done, size - done);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void fdClose(channel *ch) {
+    for(int dir = 0;dir < 2;dir++) {
+        close(ch->fd[dir][0]);
+        if(ch->fd[dir][1] != ch->fd[dir][0]) {
+            close(ch->fd[dir][1]);
+        }
+    }
+}
+
+/* Named fifos like FIFO1 and FIFO2, opened read-write so open does not wait for the peer */
+static int fifoOpen(channel *ch) {
+    const char *paths[2] = {BENCH_FIFO1, BENCH_FIFO2};
+    for(int dir = 0;dir < 2;dir++) {
+        unlink(paths[dir]);
+        if(mkfifo(paths[dir], 0666) == -1) {
+            return -1;
+        }
+        ch->fd[dir][0] = ch->fd[dir][1] = open(paths[dir], O_RDWR);
+        if(ch->fd[dir][0] == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void fifoClose(channel *ch) {
+    fdClose(ch);
+    unlink(BENCH_FIFO1);
+    unlink(BENCH_FIFO2);
+}
+
+static int pipeOpen(channel *ch) {
+    for(int dir = 0;dir < 2;dir++) {
+        if(pipe(ch->fd[dir]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int socketOpen(channel *ch) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        return -1;
+    }
+    // Parent writes sv[0] and child reads sv[1], replies go the other way
+    ch->fd[0][1] = sv[0];
+    ch->fd[0][0] = sv[1];
+    ch->fd[1][1] = sv[1];
+    ch->fd[1][0] = sv[0];
+    return 0;
+}
+
+static void socketClose(channel *ch) {
+    close(ch->fd[0][0]);
+    close(ch->fd[0][1]);
+}
+
+static int shmOpen(channel *ch) {
+    shm_unlink(BENCH_SHM);
+    int fd = shm_open(BENCH_SHM, O_CREAT | O_RDWR, 0600);
+    if(fd == -1) {
+        return -1;
+    }
+    shm_unlink(BENCH_SHM); // The mapping is inherited by the child, the name is not needed anymore
+    if(ftruncate(fd, sizeof(shmRing) * 2) == -1) {
+        close(fd);
+        return -1;
+    }
+    shmRing *rings = mmap(NULL, sizeof(shmRing) * 2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(rings == MAP_FAILED) {
+        return -1;
+    }
+    for(int dir = 0;dir < 2;dir++) {
+        ch->ring[dir] = &rings[dir];
+        atomic_store(&rings[dir].head, 0);
+        atomic_store(&rings[dir].tail, 0);
+    }
+    return 0;
+}
+
+/* Copy into the ring as space frees up, waits by yielding to the reader */
+static int shmSend(channel *ch, int dir, const char *buf, size_t size) {
+    shmRing *ring = ch->ring[dir];
+    size_t done = 0;
+    while(done < size) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t space = RING_SIZE - (head - tail);
+        if(space == 0) {
+            sched_yield();
+            continue;
+        }
+        size_t offset = head % RING_SIZE;
+        size_t n = size - done;
+        if(n > space) {
+            n = space;
+        }
+        if(n > RING_SIZE - offset) {
+            n = RING_SIZE - offset;
+        }
+        memcpy(ring->data + offset, buf + done, n);
+        atomic_store_explicit(&ring->head, head + n, memory_order_release);
+        done += n;
+    }
+    return 0;
+}
+
+static int shmRecv(channel *ch, int dir, char *buf, size_t size) {
+    shmRing *ring = ch->ring[dir];
+    size_t done = 0;
+    while(done < size) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t available = head - tail;
+        if(available == 0) {
+            sched_yield();
+            continue;
+        }
+        size_t offset = tail % RING_SIZE;
+        size_t n = size - done;
+        if(n > available) {
+            n = available;
+        }
+        if(n > RING_SIZE - offset) {
+            n = RING_SIZE - offset;
+        }
+        memcpy(buf + done, ring->data + offset, n);
+        atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+        done += n;
+    }
+    return 0;
+}
+
+static void shmClose(channel *ch) {
+    munmap(ch->ring[0], sizeof(shmRing) * 2);
+}
+
+/* Pipes driven like the --splice mode of main.c, vmsplice on send and splice into a memfd on receive */
+static int spliceOpen(channel *ch) {
+    if(pipeOpen(ch) == -1) {
+        return -1;
+    }
+    ch->memFd = memfd_create("benchsplice", MFD_CLOEXEC);
+    if(ch->memFd == -1 || ftruncate(ch->memFd, messageSizes[sizeof(messageSizes) / sizeof(messageSizes[0]) - 1]) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int spliceSend(channel *ch, int dir, const char *buf, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        struct iovec iov = { (char *)buf + done, size - done };
+        ssize_t n = vmsplice(ch->fd[dir][1], &iov, 1, 0);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int spliceRecv(channel *ch, int dir, char *buf, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        loff_t offset = done;
+        ssize_t n = splice(ch->fd[dir][0], NULL, ch->memFd, &offset, size - done, SPLICE_F_MOVE);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void spliceClose(channel *ch) {
+    fdClose(ch);
+    close(ch->memFd);
+}
+
+static const transport transports[] = {
+    {"fifo", fifoOpen, fdSend, fdRecv, fifoClose},
+    {"pipe", pipeOpen, fdSend, fdRecv, fdClose},
+    {"socketpair", socketOpen, fdSend, fdRecv, socketClose},
+    {"shm", shmOpen, shmSend, shmRecv, shmClose},
+    {"splice", spliceOpen, spliceSend, spliceRecv, spliceClose},
+};
+
+static double nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static int compareDouble(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Child side of one run, receives the stream then answers every ping */
+static void benchChild(const transport *t, channel *ch, char *buf, size_t size, long messages, int pings) {
+    for(long i = 0;i < messages;i++) {
+        if(t->recv(ch, 0, buf, size) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    if(t->send(ch, 1, buf, 1) == -1) { // Tell the parent the whole stream arrived
+        _exit(EXIT_FAILURE);
+    }
+    for(int i = 0;i < pings;i++) {
+        if(t->recv(ch, 0, buf, size) == -1 || t->send(ch, 1, buf, size) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    _exit(EXIT_SUCCESS); // Keep the parent stdout buffer out of the child
+}
+
+/* Run the stream and the ping-pong of one transport and message size, print one CSV line */
+static int benchRun(const transport *t, size_t size, char *buf, double *rtt) {
+    channel ch;
+    long messages = STREAM_BYTES / size;
+    int pings = STREAM_BYTES / size / 16;
+    int status;
+
+    if(messages > MAX_MESSAGES) {
+        messages = MAX_MESSAGES;
+    }
+    if(pings > MAX_PINGS) {
+        pings = MAX_PINGS;
+    }
+    if(pings < 100) {
+        pings = 100;
+    }
+    memset(&ch, 0, sizeof(ch));
+    if(t->open(&ch) == -1) {
+        fprintf(stderr, "%s: cannot open transport: %s\n", t->name, strerror(errno));
+        return -1;
+    }
+    pid_t pid = fork();
+    if(pid == -1) {
+        perror("Fork failed");
+        t->close(&ch);
+        return -1;
+    }
+    if(pid == 0) {
+        benchChild(t, &ch, buf, size, messages, pings);
+    }
+
+    double start = nowUs();
+    for(long i = 0;i < messages;i++) {
+        if(t->send(&ch, 0, buf, size) == -1) {
+            perror("Cannot send");
+            break;
+        }
+    }
+    t->recv(&ch, 1, buf, 1);
+    double streamUs = nowUs() - start;
+
+    for(int i = 0;i < pings;i++) {
+        double sent = nowUs();
+        if(t->send(&ch, 0, buf, size) == -1 || t->recv(&ch, 1, buf, size) == -1) {
+            perror("Cannot ping");
+            pings = i;
+            break;
+        }
+        rtt[i] = nowUs() - sent;
+    }
+    waitpid(pid, &status, 0);
+    t->close(&ch);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 || pings == 0) {
+        fprintf(stderr, "%s: run with %zu byte messages failed\n", t->name, size);
+        return -1;
+    }
+
+    qsort(rtt, pings, sizeof(double), compareDouble);
+    printf("%s,%zu,%ld,%.1f,%.2f,%.2f,%.2f,%.2f\n", t->name, size, messages,
+        (double)messages * size / streamUs, // Bytes per microsecond is MB/s
+        rtt[(pings - 1) / 2], rtt[(int)((pings - 1) * 0.90)], rtt[(int)((pings - 1) * 0.99)], rtt[pings - 1]);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t maxSize = messageSizes[sizeof(messageSizes) / sizeof(messageSizes[0]) - 1];
+    char *buf = NULL;
+    double *rtt = malloc(sizeof(double) * MAX_PINGS);
+    const char *only = argc > 1 ? argv[1] : NULL; // Optional transport name to run alone
+
+    // Page aligned so vmsplice hands over whole pages
+    if(rtt == NULL || posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), maxSize) != 0) {
+        perror("Cannot allocate the buffers");
+        return 1;
+    }
+    memset(buf, 1, maxSize);
+    printf("transport,message_bytes,messages,throughput_mb_s,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us\n");
+    fflush(stdout);
+    for(size_t i = 0;i < sizeof(transports) / sizeof(transports[0]);i++) {
+        if(only != NULL && strcmp(only, transports[i].name) != 0) {
+            continue;
+        }
+        for(size_t j = 0;j < sizeof(messageSizes) / sizeof(messageSizes[0]);j++) {
+            benchRun(&transports[i], messageSizes[j], buf, rtt);
+        }
+    }
+    free(buf);
+    free(rtt);
+    return 0;
+}
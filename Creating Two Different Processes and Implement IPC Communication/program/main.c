@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,15 +11,58 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #define FIFO_PERM (S_IRUSR | S_IWUSR)
 #define FIFO1 "/tmp/fifo1"
 #define FIFO2 "/tmp/fifo2"
+#define FIFO3 "/tmp/fifo3" // Results of the service mode, child 2 to parent
+#define SERVICE_WINDOW 64 // Jobs the parent keeps in flight in service mode
+#define STAGE_FRAME 1024 // Values in one frame between pipeline stages
+#define MAX_STAGES 16 // Stages accepted by --stages
+#define USAGE "Usage: %s <integer> [--splice] [--service <jobs>|- | --stages <kind:op[:arg],...>]\n"
 
 // Counter to hold finished child processes
 int counter = 0;
 //Signal Int flag
 int sigInt = 0;
+// Zero-copy flag, set by --splice and cleared if the kernel does not support it
+int spliceMode = 0;
+// Bytes moved by this process with vmsplice/splice and with read/write
+size_t bytesSpliced = 0;
+size_t bytesCopied = 0;
+// Service mode flag, children stay alive and process a stream of jobs
+int serviceMode = 0;
+
+// Header of a job frame, followed by numSize integers. A negative jobId ends the stream
+typedef struct {
+    int jobId;
+    int numSize;
+    char command[20];
+    int resultChild1; // Filled by child 1 before it forwards the job to child 2
+    struct timespec sent; // When the parent wrote the job, to measure latency
+} jobHeader;
+
+// Result of a job, written by child 2 to the parent
+typedef struct {
+    int jobId;
+    int result;
+    int failed; // 1 if the command could not be applied, result is not valid then
+    struct timespec sent;
+} jobResult;
+
+// One stage of a --stages pipeline
+enum { STAGE_MAP, STAGE_FILTER, STAGE_REDUCE };
+enum { OP_SQUARE, OP_DOUBLE, OP_NEGATE, OP_ADD, OP_MUL, // map
+       OP_GT, OP_GE, OP_LT, OP_LE, OP_EQ, OP_NE, OP_EVEN, OP_ODD, // filter
+       OP_SUM, OP_MULTIPLY, OP_MIN, OP_MAX, OP_COUNT }; // reduce
+typedef struct {
+    int kind;
+    int op;
+    long arg;
+} stageSpec;
 
 /* Check if str is digit */
 int checkDigit(char *str);
@@ -34,12 +78,75 @@ void intHandler(int signal_number);
 int commandCheck(char *command);
 /* Protection for zombie process function */
 void zombieProtection();
+/* Sleep until count children were reaped by the SIGCHLD handler or SIGINT came */
+void waitChildren(int count);
+/* Allocate a page aligned array for the numbers */
+int *allocNumbers(int numSize);
+/* Release an array from allocNumbers or receiveNumbers */
+void freeNumbers(int *numbers, int numSize);
+/* Write the numbers to the fifo with vmsplice, or write if splice is not supported */
+ssize_t sendNumbers(int fd, int *numbers, int numSize);
+/* Read the numbers from the fifo with splice into a memfd, or read if splice is not supported */
+int *receiveNumbers(int fd, int numSize);
+/* Print how many bytes this process spliced and copied */
+void zeroCopyReport(const char *who);
+/* Apply the command to the numbers, returns -1 if the command is invalid or a division cannot be done */
+int applyCommand(int command, int *numArr, int numSize, int *result);
+/* Write or read the whole buffer, returns -1 on error or end of file */
+int writeAll(int fd, const void *buf, size_t size);
+int readAll(int fd, void *buf, size_t size);
+/* Parent side of the service mode, sends jobs and collects results */
+int service_parent(int numSize, const char *jobs);
+/* First child process of the service mode */
+void first_service_process();
+/* Second child process of the service mode */
+void second_service_process();
+/* Parse a stage list like "map:square,filter:gt:3,reduce:sum", returns the number of stages or -1 */
+int parseStages(char *description, stageSpec *stages);
+/* Run the stages as a chain of processes connected by pipes and print the output */
+int run_pipeline(int numSize, stageSpec *stages, int stageCount);
 
 int main (int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <integer>\n", argv[0]);
+    if (argc < 2) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(0);
+    }
+    char *jobs = NULL;
+    stageSpec stages[MAX_STAGES];
+    int stageCount = 0;
+    for(int i = 2;i < argc;i++) {
+        if(strcmp(argv[i], "--splice") == 0) { // Move the array with vmsplice/splice instead of copying it
+            spliceMode = 1;
+        } else if(strcmp(argv[i], "--service") == 0 && i + 1 < argc) { // Number of jobs to generate, or - to read jobs from stdin
+            serviceMode = 1;
+            jobs = argv[++i];
+            if(strcmp(jobs, "-") != 0 && (checkDigit(jobs) != 0 || atoi(jobs) < 1)) {
+                fprintf(stderr, "Number of jobs should be greater than 0\n");
+                exit(0);
+            }
+        } else if(strcmp(argv[i], "--stages") == 0 && i + 1 < argc) { // Chain of map, filter and reduce processes
+            stageCount = parseStages(argv[++i], stages);
+            if(stageCount == -1) {
+                fprintf(stderr, "Invalid stages. Use map:<square|double|negate|add:N|mul:N>, filter:<gt|ge|lt|le|eq|ne:N|even|odd>, reduce:<sum|multiply|min|max|count>\n");
+                exit(0);
+            }
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            exit(0);
+        }
+    }
+    if(serviceMode == 1 && spliceMode == 1) { // Job buffers are reused, vmsplice needs them untouched until they are read
+        printf("--splice is not used in service mode, jobs are copied\n");
+        spliceMode = 0;
+    }
+    if(stageCount > 0 && serviceMode == 1) { // Both replace the two fifo processes, only one can run
+        fprintf(stderr, "--stages and --service cannot be used together\n");
         exit(0);
     }
+    if(stageCount > 0 && spliceMode == 1) { // Stages copy frames of numbers through their pipes
+        printf("--splice is not used with --stages, numbers are copied\n");
+        spliceMode = 0;
+    }
     int argumentNum;
     if(checkDigit(argv[1]) == 0) { // Controls if argument is digit or not
         argumentNum = atoi(argv[1]);
@@ -77,6 +184,9 @@ int main (int argc, char* argv[]) {
         printf("SIGINT caught by: %d\n", getpid());
         exit(-1);
     }
+    if(stageCount > 0) { // Pipeline stages are connected with anonymous pipes, no fifo needed
+        return run_pipeline(argumentNum, stages, stageCount);
+    }
     // Creating two fifos
     if(mkfifo(FIFO1, 0666) == -1) {
         perror("Failure to create fifo1");
@@ -86,11 +196,18 @@ int main (int argc, char* argv[]) {
         perror("Failure to create fifo2");
         exit(EXIT_FAILURE);
     }
+    if(serviceMode == 1 && mkfifo(FIFO3, 0666) == -1) {
+        perror("Failure to create fifo3");
+        unlink(FIFO1);
+        unlink(FIFO2);
+        exit(EXIT_FAILURE);
+    }
     for(int i = 0;i < 2;i++) {
         if(sigInt==1) {
             printf("SIGINT caught by: %d\n", getpid());
             unlink(FIFO1);
             unlink(FIFO2);
+            unlink(FIFO3);
             exit(-1);
         }
         pid_t pid = fork();
@@ -100,15 +217,29 @@ int main (int argc, char* argv[]) {
         } else if(pid == 0) { // Child process
             switch(i) {
                 case 0:
+                    if(serviceMode == 1) {
+                        first_service_process();
+                    }
                     first_process(argumentNum);
                     break;
                 case 1:
+                    if(serviceMode == 1) {
+                        second_service_process();
+                    }
                     second_process(argumentNum);
                     break;
             }
 
         }
     }
+    if(serviceMode == 1) {
+        int status = service_parent(argumentNum, jobs);
+        unlink(FIFO1);
+        unlink(FIFO2);
+        unlink(FIFO3);
+        zombieProtection();
+        return status;
+    }
     // Open fifos and send informations to fifos
     ssize_t byteswritten;
     // Opens fifos for writing
@@ -129,8 +260,12 @@ int main (int argc, char* argv[]) {
 	    close(fd2);
         exit(-1);
     }
-    // Create an array with random numbers
-    int randomNumbers[argumentNum];
+    // Create an array with random numbers, page aligned so vmsplice can hand its pages to the fifo
+    int *randomNumbers = allocNumbers(argumentNum);
+    if(randomNumbers == NULL) {
+        perror("Cannot allocate the array");
+        exit(-1);
+    }
     printf("Number of arrays:\n");
     for(int i = 0;i < argumentNum;i++) {
         randomNumbers[i] = rand()%5 + 1;
@@ -138,7 +273,7 @@ int main (int argc, char* argv[]) {
     }
     printf("\n");
     // Write array to fifo2
-    while(((byteswritten=write(fd2, randomNumbers, sizeof(randomNumbers)))==-1) && (errno==EINTR)); // To make sure that the string is written correctly without interrupting
+    byteswritten = sendNumbers(fd2, randomNumbers, argumentNum);
     // If the number couldn't write to the fifo
     if(byteswritten < 0) {
         perror("Cannot write to the fifo");
@@ -153,7 +288,7 @@ int main (int argc, char* argv[]) {
         exit(-1);
     }
 
-    char *command = "multiply";
+    char command[20] = "multiply"; // Fixed size so child 2 reads exactly the command and not the result of child 1
     // Writes command to fifo2
     while(((byteswritten=write(fd2, command, sizeof(command)))==-1) && (errno==EINTR)); // To make sure that the string is written correctly without interrupting
     // If the number couldn't write to the fifo
@@ -170,7 +305,7 @@ int main (int argc, char* argv[]) {
         exit(-1);
     }
     // Write the random numbers to first fifo
-    while(((byteswritten=write(fd1, randomNumbers, sizeof(randomNumbers)))==-1) && (errno==EINTR)); // To make sure that the string is written correctly without interrupting
+    byteswritten = sendNumbers(fd1, randomNumbers, argumentNum);
     // If the number couldn't write to the fifo
     if(byteswritten < 0) {
         perror("Cannot write to the fifo");
@@ -197,6 +332,10 @@ int main (int argc, char* argv[]) {
     unlink(FIFO1);
     unlink(FIFO2);
     zombieProtection();
+    if(spliceMode == 1 || bytesSpliced > 0) {
+        zeroCopyReport("Parent");
+    }
+    freeNumbers(randomNumbers, argumentNum);
     return 0;
 }
 
@@ -213,7 +352,7 @@ int checkDigit(char *str) {
 void first_process(int numSize) {
     int fd1;
     int fd2;
-    int numArr[numSize];
+    int *numArr;
     // Open first fifo for read
     while(((fd1 = open(FIFO1, O_RDONLY)) == -1) && (errno == EINTR)) ;
     if(fd1 == -1) {
@@ -226,11 +365,10 @@ void first_process(int numSize) {
         close(fd1);
         exit(-1);
     }
-    ssize_t bytesread;
     // Read number arrays which wrote from parent process
-    while(((bytesread=read(fd1, numArr, sizeof(numArr))) == -1) && (errno == EINTR)) ; // To make sure that the string is read correctly without interrupting
+    numArr = receiveNumbers(fd1, numSize);
     // If the number couldn't read from the fifo
-    if(bytesread < 0) {
+    if(numArr == NULL) {
         perror("Cannot read from the fifo");
         exit(EXIT_FAILURE);
     }
@@ -238,6 +376,7 @@ void first_process(int numSize) {
     for (int i = 0; i < numSize; i++) {
         result += numArr[i];
     }
+    freeNumbers(numArr, numSize);
     close(fd1);
     
     ssize_t byteswritten;
@@ -260,6 +399,9 @@ void first_process(int numSize) {
         exit(-1);
     }
     close(fd2);
+    if(spliceMode == 1 || bytesSpliced > 0) {
+        zeroCopyReport("Child 1");
+    }
     exit(EXIT_SUCCESS);
 }
 void second_process(int numSize) {
@@ -267,7 +409,7 @@ void second_process(int numSize) {
     char sit[20];
     int resultChild1;
     int resultChild2;
-    int numArr[numSize];
+    int *numArr;
     while(((fd = open(FIFO2, O_RDONLY)) == -1) && (errno == EINTR)) ;
     if(fd == -1) {
         fprintf(stderr, "[%ld]: Failed to open named pipe %s for read: %s\n", (long)getpid(), FIFO1, strerror(errno));
@@ -282,9 +424,9 @@ void second_process(int numSize) {
     sleep(10);
     ssize_t bytesread;
     // Read number arrays which wrote from parent process
-    while(((bytesread=read(fd, numArr, sizeof(numArr))) == -1) && (errno == EINTR)) ; // To make sure that the string is read correctly without interrupting
+    numArr = receiveNumbers(fd, numSize);
     // If couldn't read from the fifo
-    if(bytesread < 0) {
+    if(numArr == NULL) {
         perror("Cannot read from the fifo");
             exit(EXIT_FAILURE);
     }
@@ -302,7 +444,36 @@ void second_process(int numSize) {
         exit(EXIT_FAILURE);
     }
     close(fd);
-    switch(commandCheck(sit)) {
+    if(applyCommand(commandCheck(sit), numArr, numSize, &resultChild2) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Sum of the two results: %d\n", resultChild1+resultChild2);
+    freeNumbers(numArr, numSize);
+    if(spliceMode == 1 || bytesSpliced > 0) {
+        zeroCopyReport("Child 2");
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/* Signal handler function */
+void handler(int signal_number) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (WIFEXITED(status)) {
+            // Child exited normally
+            printf("Child process with PID %d terminated with status: %d\n", pid, WEXITSTATUS(status));
+        } else if (WIFSIGNALED(status)) {
+            // Child exited due to a signal
+            printf("Child process with PID %d terminated due to signal: %d\n", pid, WTERMSIG(status));
+        }
+        counter++; // Count every reaped child, signals of children exiting together are merged
+    }
+}
+
+int applyCommand(int command, int *numArr, int numSize, int *result) {
+    int resultChild2 = 0;
+    switch(command) {
         case 0:
             resultChild2 = 1;
             for (int i = 0; i < numSize; i++) {
@@ -310,8 +481,13 @@ void second_process(int numSize) {
             }
             break;
         case 1:
-            for (int i = 0; i < numSize; i++) {
-                // If not 0
+            // The first number is divided by the others
+            resultChild2 = numSize > 0 ? numArr[0] : 0;
+            for (int i = 1; i < numSize; i++) {
+                if (numArr[i] == 0 || (numArr[i] == -1 && resultChild2 == INT_MIN)) {
+                    fprintf(stderr, "Cannot divide %d by %d\n", resultChild2, numArr[i]);
+                    return -1;
+                }
                 resultChild2 /= numArr[i];
             }
             break;
@@ -326,27 +502,10 @@ void second_process(int numSize) {
             }
             break;
         default:
-            exit(EXIT_FAILURE);
-            break;
-    }
-    printf("Sum of the two results: %d\n", resultChild1+resultChild2);
-    exit(EXIT_SUCCESS);
-}
-
-/* Signal handler function */
-void handler(int signal_number) {
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        if (WIFEXITED(status)) {
-            // Child exited normally
-            printf("Child process with PID %d terminated with status: %d\n", pid, WEXITSTATUS(status));
-        } else if (WIFSIGNALED(status)) {
-            // Child exited due to a signal
-            printf("Child process with PID %d terminated due to signal: %d\n", pid, WTERMSIG(status));
-        }
+            return -1;
     }
-    counter++;
+    *result = resultChild2;
+    return 0;
 }
 
 int commandCheck(char *command) {
@@ -383,3 +542,733 @@ void zombieProtection() {
 void intHandler(int signal_number) {
     sigInt = 1;
 }
+
+void waitChildren(int count) {
+    sigset_t blocked, old;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGINT);
+    // Checked with the signals blocked, one that comes before sigsuspend is delivered when it unblocks them
+    sigprocmask(SIG_BLOCK, &blocked, &old);
+    while(counter < count && sigInt == 0) {
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Size of the mapping which holds numSize integers, rounded up to whole pages */
+static size_t numbersMapSize(int numSize) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = (size_t)numSize * sizeof(int);
+    return ((size + pageSize - 1) / pageSize) * pageSize;
+}
+
+int *allocNumbers(int numSize) {
+    int *numbers = mmap(NULL, numbersMapSize(numSize), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(numbers == MAP_FAILED) {
+        return NULL;
+    }
+    return numbers;
+}
+
+void freeNumbers(int *numbers, int numSize) {
+    munmap(numbers, numbersMapSize(numSize));
+}
+
+ssize_t sendNumbers(int fd, int *numbers, int numSize) {
+    size_t size = (size_t)numSize * sizeof(int);
+    size_t sent = 0;
+    ssize_t n;
+    while(sent < size) {
+        if(spliceMode == 1) {
+            // Pages are referenced by the pipe instead of copied, the array must not change until it is read
+            struct iovec iov = { (char *)numbers + sent, size - sent };
+            n = vmsplice(fd, &iov, 1, 0);
+            if(n == -1 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                fprintf(stderr, "[%ld]: vmsplice is not supported (%s), falling back to write\n", (long)getpid(), strerror(errno));
+                spliceMode = 0;
+                continue;
+            }
+        } else {
+            n = write(fd, (char *)numbers + sent, size - sent);
+        }
+        if(n == -1) {
+            if(errno == EINTR) { // To make sure that the array is written correctly without interrupting
+                continue;
+            }
+            return -1;
+        }
+        if(spliceMode == 1) {
+            bytesSpliced += n;
+        } else {
+            bytesCopied += n;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+int *receiveNumbers(int fd, int numSize) {
+    size_t size = (size_t)numSize * sizeof(int);
+    size_t mapSize = numbersMapSize(numSize);
+    size_t received = 0;
+    int memFd = -1;
+    int *numbers = MAP_FAILED;
+    ssize_t n;
+
+    if(spliceMode == 1) {
+        // Pages are spliced from the fifo into a memfd which is then mapped as the array
+        memFd = memfd_create("numbers", MFD_CLOEXEC);
+        if(memFd != -1 && ftruncate(memFd, mapSize) == 0) {
+            numbers = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+        }
+        if(numbers == MAP_FAILED) {
+            fprintf(stderr, "[%ld]: memfd is not supported (%s), falling back to read\n", (long)getpid(), strerror(errno));
+            if(memFd != -1) {
+                close(memFd);
+                memFd = -1;
+            }
+            spliceMode = 0;
+        }
+    }
+    if(numbers == MAP_FAILED) {
+        numbers = allocNumbers(numSize);
+        if(numbers == NULL) {
+            return NULL;
+        }
+    }
+    while(received < size) {
+        if(spliceMode == 1) {
+            loff_t offset = received;
+            n = splice(fd, NULL, memFd, &offset, size - received, SPLICE_F_MOVE);
+            if(n == -1 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                fprintf(stderr, "[%ld]: splice is not supported (%s), falling back to read\n", (long)getpid(), strerror(errno));
+                spliceMode = 0;
+                continue;
+            }
+        } else {
+            n = read(fd, (char *)numbers + received, size - received);
+        }
+        if(n == -1) {
+            if(errno == EINTR) { // To make sure that the array is read correctly without interrupting
+                continue;
+            }
+            break;
+        }
+        if(n == 0) { // Writer closed the fifo before the whole array arrived
+            errno = EPIPE;
+            n = -1;
+            break;
+        }
+        if(spliceMode == 1) {
+            bytesSpliced += n;
+        } else {
+            bytesCopied += n;
+        }
+        received += n;
+    }
+    if(memFd != -1) {
+        close(memFd); // The mapping keeps the memfd pages alive
+    }
+    if(received < size) {
+        int savedErrno = errno;
+        munmap(numbers, mapSize);
+        errno = savedErrno;
+        return NULL;
+    }
+    return numbers;
+}
+
+void zeroCopyReport(const char *who) {
+    printf("%s [%ld] zero-copy report: %zu bytes spliced, %zu bytes copied\n", who, (long)getpid(), bytesSpliced, bytesCopied);
+}
+
+int writeAll(int fd, const void *buf, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = write(fd, (const char *)buf + done, size - done);
+        if(n == -1) {
+            if(errno == EINTR) { // To make sure that the buffer is written correctly without interrupting
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int readAll(int fd, void *buf, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = read(fd, (char *)buf + done, size - done);
+        if(n == -1) {
+            if(errno == EINTR) { // To make sure that the buffer is read correctly without interrupting
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0) { // Writer closed the fifo
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* Milliseconds between two monotonic times */
+static double elapsedMs(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int compareDouble(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Parse one "command n1 n2 ..." line from stdin into a job, returns -1 if the line has no job */
+static int parseJobLine(char *line, jobHeader *header, int *numArr, int maxSize) {
+    char *token = strtok(line, " \t\n");
+    if(token == NULL) {
+        return -1;
+    }
+    if(commandCheck(token) == -1) {
+        return -1;
+    }
+    snprintf(header->command, sizeof(header->command), "%s", token);
+    header->numSize = 0;
+    while((token = strtok(NULL, " \t\n")) != NULL) {
+        if(header->numSize == maxSize) {
+            fprintf(stderr, "Job has more than %d numbers, rest is ignored\n", maxSize);
+            break;
+        }
+        char *end;
+        errno = 0;
+        long number = strtol(token, &end, 10);
+        if(errno != 0 || *end != '\0' || number < INT_MIN || number > INT_MAX) {
+            fprintf(stderr, "Invalid number %s\n", token);
+            return -1;
+        }
+        numArr[header->numSize++] = number;
+    }
+    return header->numSize > 0 ? 0 : -1;
+}
+
+/* Read the next result from child 2 and print it, results arrive in job order because the pipeline is a single chain of fifos */
+static int collectResult(int fd, int expectedId, double *latencies) {
+    jobResult result;
+    struct timespec now;
+    if(readAll(fd, &result, sizeof(result)) == -1) {
+        perror("Cannot read from the fifo");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(result.jobId != expectedId) {
+        fprintf(stderr, "Result of job %d arrived while waiting for job %d\n", result.jobId, expectedId);
+        return -1;
+    }
+    latencies[result.jobId] = elapsedMs(&result.sent, &now);
+    if(result.failed) {
+        printf("Job %d: error\n", result.jobId);
+    } else {
+        printf("Job %d: %d\n", result.jobId, result.result);
+    }
+    return 0;
+}
+
+int service_parent(int numSize, const char *jobs) {
+    int fd1;
+    int fd3;
+    int fromStdin = strcmp(jobs, "-") == 0;
+    int jobCount = fromStdin ? 0 : atoi(jobs);
+    int latencyCapacity = fromStdin ? 1024 : jobCount;
+    double *latencies = malloc(sizeof(double) * latencyCapacity);
+    int *numArr = malloc(sizeof(int) * numSize);
+    char *line = NULL;
+    size_t lineSize = 0;
+    int sentJobs = 0;
+    int doneJobs = 0;
+    int status = 0;
+    jobHeader header;
+    struct timespec start, end;
+
+    if(latencies == NULL || numArr == NULL) {
+        perror("Cannot allocate the jobs");
+        return -1;
+    }
+    while(((fd1 = open(FIFO1, O_WRONLY)) == -1) && (errno == EINTR)) ;
+    if(fd1 == -1) {
+        fprintf(stderr, "[%ld]: Failed to open named pipe %s for write: %s\n", (long)getpid(), FIFO1, strerror(errno));
+        return -1;
+    }
+    while(((fd3 = open(FIFO3, O_RDONLY)) == -1) && (errno == EINTR)) ;
+    if(fd3 == -1) {
+        fprintf(stderr, "[%ld]: Failed to open named pipe %s for read: %s\n", (long)getpid(), FIFO3, strerror(errno));
+        close(fd1);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(sigInt == 0) {
+        memset(&header, 0, sizeof(header));
+        if(fromStdin) {
+            if(getline(&line, &lineSize, stdin) == -1) {
+                break;
+            }
+            if(parseJobLine(line, &header, numArr, numSize) == -1) {
+                fprintf(stderr, "Invalid job, expected: <multiply|divide|substract|sum> <numbers...>\n");
+                continue;
+            }
+            if(sentJobs == latencyCapacity) {
+                latencyCapacity *= 2;
+                double *grown = realloc(latencies, sizeof(double) * latencyCapacity);
+                if(grown == NULL) {
+                    perror("Cannot allocate the jobs");
+                    status = -1;
+                    break;
+                }
+                latencies = grown;
+            }
+        } else {
+            if(sentJobs == jobCount) {
+                break;
+            }
+            strcpy(header.command, "multiply");
+            header.numSize = numSize;
+            for(int i = 0;i < numSize;i++) {
+                numArr[i] = rand()%5 + 1;
+            }
+        }
+        // Keep a bounded number of jobs in flight so fifo3 never fills while the parent is writing
+        if(sentJobs - doneJobs == SERVICE_WINDOW) {
+            if(collectResult(fd3, doneJobs, latencies) == -1) {
+                status = -1;
+                break;
+            }
+            doneJobs++;
+        }
+        header.jobId = sentJobs;
+        clock_gettime(CLOCK_MONOTONIC, &header.sent);
+        if(writeAll(fd1, &header, sizeof(header)) == -1 || writeAll(fd1, numArr, sizeof(int) * header.numSize) == -1) {
+            perror("Cannot write to the fifo");
+            status = -1;
+            break;
+        }
+        sentJobs++;
+    }
+    // End of the stream, children exit after they pass it on
+    memset(&header, 0, sizeof(header));
+    header.jobId = -1;
+    writeAll(fd1, &header, sizeof(header));
+    close(fd1);
+    while(status == 0 && sigInt == 0 && doneJobs < sentJobs) {
+        if(collectResult(fd3, doneJobs, latencies) == -1) {
+            status = -1;
+            break;
+        }
+        doneJobs++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd3);
+    if(sigInt == 1) {
+        printf("SIGINT caught by: %d\n", getpid());
+        status = -1;
+    }
+
+    if(doneJobs > 0) {
+        double totalMs = elapsedMs(&start, &end);
+        double sum = 0;
+        for(int i = 0;i < doneJobs;i++) {
+            sum += latencies[i];
+        }
+        qsort(latencies, doneJobs, sizeof(double), compareDouble);
+        printf("Service statistics:\n");
+        printf("Jobs: %d - Elapsed: %.3f ms - Throughput: %.1f jobs/s\n", doneJobs, totalMs, doneJobs / (totalMs / 1000.0));
+        printf("Latency (ms): mean %.3f - p50 %.3f - p99 %.3f - max %.3f\n", sum / doneJobs,
+            latencies[(doneJobs - 1) / 2], latencies[(int)((doneJobs - 1) * 0.99)], latencies[doneJobs - 1]);
+    }
+    free(line);
+    free(numArr);
+    free(latencies);
+    waitChildren(2); // Wait for both children to leave
+    return status;
+}
+
+void first_service_process() {
+    int fd1;
+    int fd2;
+    int capacity = 0;
+    int *numArr = NULL;
+    jobHeader header;
+    while(((fd1 = open(FIFO1, O_RDONLY)) == -1) && (errno == EINTR)) ;
+    if(fd1 == -1) {
+        fprintf(stderr, "[%ld]: Failed to open named pipe %s for read: %s\n", (long)getpid(), FIFO1, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while(((fd2 = open(FIFO2, O_WRONLY)) == -1) && (errno == EINTR)) ;
+    if(fd2 == -1) {
+        fprintf(stderr, "[%ld]: Failed to open named pipe %s for write: %s\n", (long)getpid(), FIFO2, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while(1) {
+        if(sigInt == 1) {
+            printf("SIGINT caught by: %d\n", getpid());
+            close(fd1);
+            close(fd2);
+            exit(-1);
+        }
+        if(readAll(fd1, &header, sizeof(header)) == -1) {
+            perror("Cannot read from the fifo");
+            exit(EXIT_FAILURE);
+        }
+        if(header.jobId < 0) { // Pass the end of the stream to child 2
+            writeAll(fd2, &header, sizeof(header));
+            break;
+        }
+        if(header.numSize > capacity) {
+            capacity = header.numSize;
+            free(numArr);
+            numArr = malloc(sizeof(int) * capacity);
+            if(numArr == NULL) {
+                perror("Cannot allocate the job");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(readAll(fd1, numArr, sizeof(int) * header.numSize) == -1) {
+            perror("Cannot read from the fifo");
+            exit(EXIT_FAILURE);
+        }
+        header.resultChild1 = 0;
+        for (int i = 0; i < header.numSize; i++) {
+            header.resultChild1 += numArr[i];
+        }
+        // Forward the job with its sum to child 2
+        if(writeAll(fd2, &header, sizeof(header)) == -1 || writeAll(fd2, numArr, sizeof(int) * header.numSize) == -1) {
+            perror("Cannot write to the fifo");
+            exit(-1);
+        }
+    }
+    free(numArr);
+    close(fd1);
+    close(fd2);
+    exit(EXIT_SUCCESS);
+}
+
+void second_service_process() {
+    int fd2;
+    int fd3;
+    int capacity = 0;
+    int *numArr = NULL;
+    jobHeader header;
+    jobResult result;
+    while(((fd2 = open(FIFO2, O_RDONLY)) == -1) && (errno == EINTR)) ;
+    if(fd2 == -1) {
+        fprintf(stderr, "[%ld]: Failed to open named pipe %s for read: %s\n", (long)getpid(), FIFO2, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while(((fd3 = open(FIFO3, O_WRONLY)) == -1) && (errno == EINTR)) ;
+    if(fd3 == -1) {
+        fprintf(stderr, "[%ld]: Failed to open named pipe %s for write: %s\n", (long)getpid(), FIFO3, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while(1) {
+        if(sigInt == 1) {
+            printf("SIGINT caught by: %d\n", getpid());
+            close(fd2);
+            close(fd3);
+            exit(-1);
+        }
+        if(readAll(fd2, &header, sizeof(header)) == -1) {
+            perror("Cannot read from the fifo");
+            exit(EXIT_FAILURE);
+        }
+        if(header.jobId < 0) {
+            break;
+        }
+        if(header.numSize > capacity) {
+            capacity = header.numSize;
+            free(numArr);
+            numArr = malloc(sizeof(int) * capacity);
+            if(numArr == NULL) {
+                perror("Cannot allocate the job");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(readAll(fd2, numArr, sizeof(int) * header.numSize) == -1) {
+            perror("Cannot read from the fifo");
+            exit(EXIT_FAILURE);
+        }
+        result.jobId = header.jobId;
+        result.sent = header.sent;
+        // A job that cannot be computed is reported as failed, the next jobs go on
+        result.failed = applyCommand(commandCheck(header.command), numArr, header.numSize, &result.result) == -1;
+        result.result = result.failed ? 0 : result.result + header.resultChild1;
+        if(writeAll(fd3, &result, sizeof(result)) == -1) {
+            perror("Cannot write to the fifo");
+            exit(-1);
+        }
+    }
+    free(numArr);
+    close(fd2);
+    close(fd3);
+    exit(EXIT_SUCCESS);
+}
+
+/* Parse the number after "op:" of a stage */
+static int parseStageArgument(char *text, long *arg) {
+    char *end;
+    if(text == NULL) {
+        return -1;
+    }
+    errno = 0;
+    *arg = strtol(text, &end, 10);
+    return (errno != 0 || *end != '\0' || end == text) ? -1 : 0;
+}
+
+int parseStages(char *description, stageSpec *stages) {
+    static const struct {
+        int kind;
+        const char *name;
+        int op;
+        int hasArg;
+    } ops[] = {
+        {STAGE_MAP, "square", OP_SQUARE, 0}, {STAGE_MAP, "double", OP_DOUBLE, 0}, {STAGE_MAP, "negate", OP_NEGATE, 0},
+        {STAGE_MAP, "add", OP_ADD, 1}, {STAGE_MAP, "mul", OP_MUL, 1},
+        {STAGE_FILTER, "gt", OP_GT, 1}, {STAGE_FILTER, "ge", OP_GE, 1}, {STAGE_FILTER, "lt", OP_LT, 1},
+        {STAGE_FILTER, "le", OP_LE, 1}, {STAGE_FILTER, "eq", OP_EQ, 1}, {STAGE_FILTER, "ne", OP_NE, 1},
+        {STAGE_FILTER, "even", OP_EVEN, 0}, {STAGE_FILTER, "odd", OP_ODD, 0},
+        {STAGE_REDUCE, "sum", OP_SUM, 0}, {STAGE_REDUCE, "multiply", OP_MULTIPLY, 0}, {STAGE_REDUCE, "min", OP_MIN, 0},
+        {STAGE_REDUCE, "max", OP_MAX, 0}, {STAGE_REDUCE, "count", OP_COUNT, 0},
+    };
+    int count = 0;
+    char *saveStage;
+    for(char *stage = strtok_r(description, ",", &saveStage); stage != NULL; stage = strtok_r(NULL, ",", &saveStage)) {
+        char *saveField;
+        char *kindName = strtok_r(stage, ":", &saveField);
+        char *opName = strtok_r(NULL, ":", &saveField);
+        char *argText = strtok_r(NULL, ":", &saveField);
+        int kind;
+        int found = 0;
+        if(count == MAX_STAGES || kindName == NULL || opName == NULL) {
+            return -1;
+        }
+        if(strcmp(kindName, "map") == 0) {
+            kind = STAGE_MAP;
+        } else if(strcmp(kindName, "filter") == 0) {
+            kind = STAGE_FILTER;
+        } else if(strcmp(kindName, "reduce") == 0) {
+            kind = STAGE_REDUCE;
+        } else {
+            return -1;
+        }
+        for(size_t i = 0;i < sizeof(ops) / sizeof(ops[0]);i++) {
+            if(ops[i].kind == kind && strcmp(ops[i].name, opName) == 0) {
+                stages[count].kind = kind;
+                stages[count].op = ops[i].op;
+                stages[count].arg = 0;
+                if(ops[i].hasArg && parseStageArgument(argText, &stages[count].arg) == -1) {
+                    return -1;
+                }
+                if(!ops[i].hasArg && argText != NULL) {
+                    return -1;
+                }
+                found = 1;
+                break;
+            }
+        }
+        if(!found) {
+            return -1;
+        }
+        count++;
+    }
+    return count > 0 ? count : -1;
+}
+
+/* Write one frame, a count followed by the values */
+static int writeFrame(int fd, long *values, int count) {
+    if(writeAll(fd, &count, sizeof(count)) == -1 || writeAll(fd, values, sizeof(long) * count) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Read one frame, returns the number of values or -1 at the end of the stream */
+static int readFrame(int fd, long *values) {
+    int count;
+    if(readAll(fd, &count, sizeof(count)) == -1 || count < 0 || count > STAGE_FRAME) {
+        return -1;
+    }
+    if(readAll(fd, values, sizeof(long) * count) == -1) {
+        return -1;
+    }
+    return count;
+}
+
+/* First process of the pipeline, streams random numbers in frames */
+static void source_process(int numSize, int outFd) {
+    long frame[STAGE_FRAME];
+    int count = 0;
+    for(int i = 0;i < numSize && sigInt == 0;i++) {
+        frame[count++] = rand()%5 + 1;
+        if(count == STAGE_FRAME) {
+            if(writeFrame(outFd, frame, count) == -1) { // Blocks while the next stage is behind
+                perror("Cannot write to the pipe");
+                exit(EXIT_FAILURE);
+            }
+            count = 0;
+        }
+    }
+    if(count > 0 && writeFrame(outFd, frame, count) == -1) {
+        perror("Cannot write to the pipe");
+        exit(EXIT_FAILURE);
+    }
+    close(outFd);
+    exit(sigInt == 1 ? -1 : EXIT_SUCCESS);
+}
+
+/* Stage process, applies its operation to every frame and passes the result on */
+static void stage_process(stageSpec *stage, int inFd, int outFd) {
+    long in[STAGE_FRAME];
+    long out[STAGE_FRAME];
+    long accumulator = 0;
+    long seen = 0;
+    int count;
+    switch(stage->op) {
+        case OP_MULTIPLY: accumulator = 1; break;
+        case OP_MIN: accumulator = LONG_MAX; break;
+        case OP_MAX: accumulator = LONG_MIN; break;
+    }
+    while((count = readFrame(inFd, in)) != -1) {
+        int outCount = 0;
+        if(sigInt == 1) {
+            printf("SIGINT caught by: %d\n", getpid());
+            exit(-1);
+        }
+        for(int i = 0;i < count;i++) {
+            long v = in[i];
+            switch(stage->op) {
+                case OP_SQUARE: out[outCount++] = v * v; break;
+                case OP_DOUBLE: out[outCount++] = v * 2; break;
+                case OP_NEGATE: out[outCount++] = -v; break;
+                case OP_ADD: out[outCount++] = v + stage->arg; break;
+                case OP_MUL: out[outCount++] = v * stage->arg; break;
+                case OP_GT: if(v > stage->arg) out[outCount++] = v; break;
+                case OP_GE: if(v >= stage->arg) out[outCount++] = v; break;
+                case OP_LT: if(v < stage->arg) out[outCount++] = v; break;
+                case OP_LE: if(v <= stage->arg) out[outCount++] = v; break;
+                case OP_EQ: if(v == stage->arg) out[outCount++] = v; break;
+                case OP_NE: if(v != stage->arg) out[outCount++] = v; break;
+                case OP_EVEN: if(v % 2 == 0) out[outCount++] = v; break;
+                case OP_ODD: if(v % 2 != 0) out[outCount++] = v; break;
+                case OP_SUM: accumulator += v; break;
+                case OP_MULTIPLY: accumulator *= v; break;
+                case OP_MIN: if(v < accumulator) accumulator = v; break;
+                case OP_MAX: if(v > accumulator) accumulator = v; break;
+                case OP_COUNT: accumulator++; break;
+            }
+            seen++;
+        }
+        // Map and filter pass every frame on at once so the next stage works while this one reads
+        if(outCount > 0 && writeFrame(outFd, out, outCount) == -1) {
+            perror("Cannot write to the pipe");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Reduce has one value once its input ends, min and max of an empty stream have none
+    if(stage->kind == STAGE_REDUCE && (seen > 0 || stage->op == OP_SUM || stage->op == OP_MULTIPLY || stage->op == OP_COUNT)) {
+        if(writeFrame(outFd, &accumulator, 1) == -1) {
+            perror("Cannot write to the pipe");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(inFd);
+    close(outFd);
+    exit(EXIT_SUCCESS);
+}
+
+int run_pipeline(int numSize, stageSpec *stages, int stageCount) {
+    int pipes[MAX_STAGES + 1][2];
+    long frame[STAGE_FRAME];
+    long outputCount = 0;
+    long outputSum = 0;
+    long firstValues[32];
+    int count;
+    struct timespec start, end;
+
+    // Pipe i feeds stage i, the last pipe goes back to the parent
+    for(int i = 0;i <= stageCount;i++) {
+        if(pipe(pipes[i]) == -1) {
+            perror("Failure to create pipe");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // The SIGCHLD handler prints, a line it buffers while stages are forked would be printed again by the later stages
+    sigset_t childSignal, oldMask;
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, &oldMask);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Process 0 is the source of the numbers, process i + 1 runs stage i
+    for(int i = 0;i <= stageCount;i++) {
+        pid_t pid = fork();
+        if(pid == -1) {
+            perror("Fork failed");
+            exit(1);
+        } else if(pid == 0) {
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            int inFd = i == 0 ? -1 : pipes[i - 1][0];
+            int outFd = pipes[i][1];
+            // Close every other end, otherwise the next stage never sees the end of the stream
+            for(int j = 0;j <= stageCount;j++) {
+                if(pipes[j][0] != inFd) {
+                    close(pipes[j][0]);
+                }
+                if(pipes[j][1] != outFd) {
+                    close(pipes[j][1]);
+                }
+            }
+            if(i == 0) {
+                source_process(numSize, outFd);
+            }
+            stage_process(&stages[i - 1], inFd, outFd);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    for(int i = 0;i < stageCount;i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    close(pipes[stageCount][1]);
+
+    while((count = readFrame(pipes[stageCount][0], frame)) != -1) {
+        for(int i = 0;i < count;i++) {
+            if(outputCount < 32) {
+                firstValues[outputCount] = frame[i];
+            }
+            outputSum += frame[i];
+            outputCount++;
+        }
+    }
+    close(pipes[stageCount][0]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    waitChildren(stageCount + 1); // Wait for the source and every stage to leave
+    if(sigInt == 1) {
+        printf("SIGINT caught by: %d\n", getpid());
+        return -1;
+    }
+
+    printf("Pipeline output (%ld values):\n", outputCount);
+    for(long i = 0;i < outputCount && i < 32;i++) {
+        printf("%ld ", firstValues[i]);
+    }
+    if(outputCount > 32) {
+        printf("... (sum %ld)", outputSum);
+    }
+    printf("\n");
+    double totalMs = elapsedMs(&start, &end);
+    printf("Stages: %d - Numbers: %d - Elapsed: %.3f ms - Throughput: %.1f numbers/s\n", stageCount, numSize, totalMs, numSize / (totalMs / 1000.0));
+    zombieProtection();
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/*
+ * Copy engine of the workers. Each file tries the cheapest method first and
+ * falls back when the filesystem or kernel cannot do it:
+ * reflink (FICLONE) shares the extents and copies nothing,
+ * copy_file_range and sendfile copy inside the kernel,
+ * the buffer loop is the old read/write copy with a bigger buffer.
+ */
+
+#define COPY_REFLINK 0
+#define COPY_RANGE 1
+#define COPY_SENDFILE 2
+#define COPY_BUFFER 3
+#define COPY_BLOCKS 4 // --blocks, only the blocks that differ are written
+#define COPY_DEDUP 5 // --dedup, an earlier copy with the same content was reflinked or linked
+#define COPY_URING 6 // --engine uring, reads and writes of registered buffers in flight
+#define COPY_PACKED 7 // Small files read together into one buffer, then written together
+#define COPY_METHODS 8
+
+#define COPY_CHUNK (16 * 1024 * 1024) // Bytes per kernel call, so SIGINT is noticed between calls
+#define COPY_BUFFER_SIZE (1024 * 1024) // Buffer of the read/write loop, was 1024 bytes on the stack
+#define SYNC_BLOCK (64 * 1024) // Unit compared and rewritten by syncRange
+
+const char *copyMethodNames[COPY_METHODS] = {"reflink", "copy_file_range", "sendfile", "read/write", "changed blocks", "dedup", "io_uring", "packed"};
+
+/* Errors after which the next method is tried, only if nothing was copied yet */
+int unsupported(int error) {
+    return error == EXDEV || error == ENOSYS || error == EINVAL || error == EOPNOTSUPP || error == ENOTTY;
+}
+
+/* Share all blocks of srcFd with destFd on btrfs/XFS, returns 1 if it worked */
+int reflink(int srcFd, int destFd) {
+    return ioctl(destFd, FICLONE, srcFd) == 0;
+}
+
+long copyExtents(int srcFd, int destFd, long offset, long length, char *buffer, int *method, int *stop);
+
+/* Returns 1 if the file has fewer blocks than its size needs, so it has holes */
+int sparse(struct stat *statBuf) {
+    return statBuf->st_blocks * 512L < statBuf->st_size;
+}
+
+/* Copy srcFd to destFd with the first method that works, returns bytes copied or -1 */
+long copyFile(int srcFd, int destFd, char *buffer, int *method, int *stop) {
+    long total = 0;
+    ssize_t n = 0;
+
+    struct stat statBuf;
+    if (fstat(srcFd, &statBuf) == -1) {
+        perror("Error getting file status");
+        return -1;
+    }
+
+    // Reflink shares the blocks, the whole file is done in one call
+    if (reflink(srcFd, destFd)) {
+        *method = COPY_REFLINK;
+        return statBuf.st_size;
+    }
+
+    // copy_file_range and read/write would write the holes as zeros, copy only the data and extend the file over the holes
+    if (sparse(&statBuf)) {
+        if (ftruncate(destFd, statBuf.st_size) == -1) {
+            perror("Error setting destination file size");
+            return -1;
+        }
+        return copyExtents(srcFd, destFd, 0, statBuf.st_size, buffer, method, stop);
+    }
+
+    *method = COPY_RANGE;
+    while (!*stop && (n = copy_file_range(srcFd, NULL, destFd, NULL, COPY_CHUNK, 0)) > 0) {
+        total += n;
+    }
+    if (n != -1 || total > 0 || !unsupported(errno)) {
+        if (n == -1) {
+            perror("Error copying file");
+            return -1;
+        }
+        return total;
+    }
+
+    *method = COPY_SENDFILE;
+    while (!*stop && (n = sendfile(destFd, srcFd, NULL, COPY_CHUNK)) > 0) {
+        total += n;
+    }
+    if (n != -1 || total > 0 || !unsupported(errno)) {
+        if (n == -1) {
+            perror("Error copying file");
+            return -1;
+        }
+        return total;
+    }
+
+    *method = COPY_BUFFER;
+    while (!*stop && (n = read(srcFd, buffer, COPY_BUFFER_SIZE)) > 0) {
+        if (write(destFd, buffer, n) != n) {
+            perror("Error writing to destination file");
+            return -1;
+        }
+        total += n;
+    }
+    if (n == -1) {
+        perror("Error reading source file");
+        return -1;
+    }
+    return total;
+}
+
+/* Copy length bytes at offset without moving the file offsets, so several workers can copy one file */
+long copyRange(int srcFd, int destFd, long offset, long length, char *buffer, int *method, int *stop) {
+    long total = 0;
+    ssize_t n = 0;
+
+    // Chunks start on a multiple of the chunk size, so they are block aligned for a ranged reflink
+    struct file_clone_range range = {srcFd, offset, length, offset};
+    if (ioctl(destFd, FICLONERANGE, &range) == 0) {
+        *method = COPY_REFLINK;
+        return length;
+    }
+
+    *method = COPY_RANGE;
+    loff_t in = offset, out = offset;
+    while (!*stop && total < length && (n = copy_file_range(srcFd, &in, destFd, &out, length - total < COPY_CHUNK ? length - total : COPY_CHUNK, 0)) > 0) {
+        total += n;
+    }
+    if (n != -1 || total > 0 || !unsupported(errno)) {
+        if (n == -1) {
+            perror("Error copying file");
+            return -1;
+        }
+        return total;
+    }
+
+    *method = COPY_BUFFER;
+    while (!*stop && total < length && (n = pread(srcFd, buffer, length - total < COPY_BUFFER_SIZE ? length - total : COPY_BUFFER_SIZE, offset + total)) > 0) {
+        if (pwrite(destFd, buffer, n, offset + total) != n) {
+            perror("Error writing to destination file");
+            return -1;
+        }
+        total += n;
+    }
+    if (n == -1) {
+        perror("Error reading source file");
+        return -1;
+    }
+    return total;
+}
+
+/* Copy the data extents in length bytes at offset and leave the holes, the destination must already have its size.
+   Returns bytes written or -1 */
+long copyExtents(int srcFd, int destFd, long offset, long length, char *buffer, int *method, int *stop) {
+    long end = offset + length;
+    long total = 0;
+    *method = COPY_RANGE;
+    while (!*stop && offset < end) {
+        off_t data = lseek(srcFd, offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) {
+            break; // Only a hole is left
+        }
+        off_t hole = data == -1 ? -1 : lseek(srcFd, data, SEEK_HOLE);
+        if (data == -1 || hole == -1) {
+            data = offset; // The filesystem cannot tell, copy the rest
+            hole = end;
+        }
+        if (data >= end) {
+            break;
+        }
+        if (hole > end) {
+            hole = end;
+        }
+        long n = copyRange(srcFd, destFd, data, hole - data, buffer, method, stop);
+        if (n == -1) {
+            return -1;
+        }
+        total += n;
+        offset = hole;
+    }
+    return total;
+}
+
+/* Compare length bytes at offset with the destination and write only the blocks that differ, returns bytes written or -1.
+   buffer holds two COPY_BUFFER_SIZE halves, one for each file */
+long syncRange(int srcFd, int destFd, long offset, long length, char *buffer, int *stop) {
+    char *destBuffer = buffer + COPY_BUFFER_SIZE;
+    long done = 0, written = 0;
+    while (!*stop && done < length) {
+        ssize_t n = pread(srcFd, buffer, length - done < COPY_BUFFER_SIZE ? length - done : COPY_BUFFER_SIZE, offset + done);
+        if (n == -1) {
+            perror("Error reading source file");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        ssize_t m = pread(destFd, destBuffer, n, offset + done); // Short when the destination is smaller
+        if (m == -1) {
+            m = 0;
+        }
+        for (ssize_t block = 0; block < n; block += SYNC_BLOCK) {
+            ssize_t size = n - block < SYNC_BLOCK ? n - block : SYNC_BLOCK;
+            if (block + size <= m && memcmp(buffer + block, destBuffer + block, size) == 0) {
+                continue;
+            }
+            if (pwrite(destFd, buffer + block, size, offset + done + block) != size) {
+                perror("Error writing to destination file");
+                return -1;
+            }
+            written += size;
+        }
+        done += n;
+    }
+    return written;
+}
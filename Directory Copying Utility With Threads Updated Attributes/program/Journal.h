@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+ * Append-only journal of the files and chunks that are completely copied,
+ * kept in the destination directory for --journal and --resume. Workers
+ * add records to a buffer in memory; the reporter commits the buffer every
+ * few seconds: syncfs first, so the copied data is on disk before any
+ * record that claims it, then one write and one fdatasync for the whole
+ * batch. A crash loses at most the last batch, those files are copied
+ * again. Each record carries the size and modification time of the source,
+ * so a record of a file that changed since does not match it any more.
+ *
+ * F <size> <mtime sec> <mtime nsec> <path>\n          whole file
+ * C <size> <mtime sec> <mtime nsec> <offset> <path>\n chunk at offset
+ */
+
+#define JOURNAL_NAME ".mwcp-journal"
+
+int journalFd = -1; // -1 without --journal and --resume
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+char *journalBuffer = NULL; // Records not committed yet
+size_t journalUsed = 0;
+size_t journalCapacity = 0;
+
+/* 64-bit FNV-1a hash of a path */
+uint64_t pathHash(const char *path) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (; *path; path++) {
+        h = (h ^ (unsigned char)*path) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* Key of a record for the table, offset is -1 for a whole file */
+uint64_t journalStamp(long size, long mtimeSec, long mtimeNsec, long offset) {
+    uint64_t h = (uint64_t)size * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)mtimeSec * 0xBF58476D1CE4E5B9ULL + (uint64_t)mtimeNsec;
+    h ^= (uint64_t)(offset + 1) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+/* Open the journal in the destination, with resume read its records into table and keep appending,
+   otherwise start an empty one. Returns 0 if it could not be opened */
+int journalOpen(int destFd, int resume, linkTable *table) {
+    journalFd = openat(destFd, JOURNAL_NAME, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    if (journalFd == -1) {
+        perror("Error opening journal");
+        return 0;
+    }
+    if (!resume) {
+        return 1;
+    }
+    FILE *in = fdopen(dup(journalFd), "r");
+    if (in == NULL) {
+        perror("Error reading journal");
+        return 0;
+    }
+    char line[2 * PATH_SIZE];
+    long complete = 0; // End of the last whole line, a crash may leave half a line behind it
+    while (fgets(line, sizeof(line), in) != NULL) {
+        size_t length = strlen(line);
+        if (length == 0 || line[length - 1] != '\n') {
+            break;
+        }
+        line[length - 1] = '\0';
+        long size, sec, nsec, offset = -1;
+        int used = 0;
+        if ((line[0] == 'F' && sscanf(line, "F %ld %ld %ld %n", &size, &sec, &nsec, &used) == 3 && used > 0)
+            || (line[0] == 'C' && sscanf(line, "C %ld %ld %ld %ld %n", &size, &sec, &nsec, &offset, &used) == 4 && used > 0)) {
+            findOrAdd(table, pathHash(line + used), journalStamp(size, sec, nsec, offset), line + used);
+        }
+        complete += length;
+    }
+    fclose(in);
+    if (ftruncate(journalFd, complete) == -1 || lseek(journalFd, complete, SEEK_SET) == -1) {
+        perror("Error trimming journal");
+    }
+    return 1;
+}
+
+/* Returns 1 if the journal of the run that is resumed has the record */
+int journaled(linkTable *table, const char *path, long size, long mtimeSec, long mtimeNsec, long offset) {
+    const char *found = findOrAdd(table, pathHash(path), journalStamp(size, mtimeSec, mtimeNsec, offset), NULL);
+    return found != NULL && strcmp(found, path) == 0;
+}
+
+/* Add a record to the next batch, offset is -1 for a whole file */
+void journalAdd(const char *path, long size, long mtimeSec, long mtimeNsec, long offset) {
+    if (strchr(path, '\n') != NULL) {
+        return; // Cannot be a line of the journal, such a file is copied again on resume
+    }
+    char record[2 * PATH_SIZE];
+    int length = offset < 0 ? snprintf(record, sizeof(record), "F %ld %ld %ld %s\n", size, mtimeSec, mtimeNsec, path)
+                            : snprintf(record, sizeof(record), "C %ld %ld %ld %ld %s\n", size, mtimeSec, mtimeNsec, offset, path);
+    if (length >= (int)sizeof(record)) {
+        return;
+    }
+    pthread_mutex_lock(&journalLock);
+    if (journalUsed + length > journalCapacity) {
+        journalCapacity = journalCapacity == 0 ? 64 * 1024 : journalCapacity * 2;
+        journalBuffer = realloc(journalBuffer, journalCapacity);
+        if (journalBuffer == NULL) {
+            perror("Error allocating journal buffer");
+            exit(1);
+        }
+    }
+    memcpy(journalBuffer + journalUsed, record, length);
+    journalUsed += length;
+    pthread_mutex_unlock(&journalLock);
+}
+
+/* Make the copied data durable, then append the batch and make it durable, only the reporter calls it.
+   If the data cannot be synced the batch is kept for the next commit */
+void journalCommit(int destFd) {
+    pthread_mutex_lock(&journalLock);
+    char *batch = journalBuffer;
+    size_t used = journalUsed;
+    journalBuffer = NULL;
+    journalUsed = 0;
+    journalCapacity = 0;
+    pthread_mutex_unlock(&journalLock);
+    if (used == 0) {
+        free(batch);
+        return;
+    }
+    if (syncfs(destFd) == -1) {
+        // The data of these records may not be on disk, so they wait in front of the next batch for another sync
+        perror("Error syncing destination");
+        pthread_mutex_lock(&journalLock);
+        size_t capacity = used + journalUsed > 64 * 1024 ? used + journalUsed : 64 * 1024;
+        char *merged = realloc(batch, capacity);
+        if (merged == NULL) {
+            perror("Error allocating journal buffer");
+            exit(1);
+        }
+        if (journalUsed > 0) {
+            memcpy(merged + used, journalBuffer, journalUsed);
+        }
+        free(journalBuffer);
+        journalBuffer = merged;
+        journalUsed += used;
+        journalCapacity = capacity;
+        pthread_mutex_unlock(&journalLock);
+        return;
+    }
+    size_t done = 0;
+    while (done < used) {
+        ssize_t n = write(journalFd, batch + done, used - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing journal");
+            break;
+        }
+        done += n;
+    }
+    if (fdatasync(journalFd) == -1) {
+        perror("Error syncing journal");
+    }
+    free(batch);
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * Tables of destination paths for --hardlinks and --dedup. The hard link
+ * table maps (st_dev, st_ino) of a source file with several links to the
+ * destination of its first link, the content table maps (size, hash) of a
+ * copied file to its destination. Both are open addressing hash tables
+ * behind one mutex each, paths are never removed until the run ends.
+ */
+
+typedef struct {
+    uint64_t key1;
+    uint64_t key2;
+    char *path; // NULL for an empty slot
+} linkSlot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    linkSlot *slots;
+    size_t capacity; // Power of two
+    size_t count;
+} linkTable;
+
+/* Initialize an empty table */
+void initTable(linkTable *table) {
+    pthread_mutex_init(&table->lock, NULL);
+    table->capacity = 1024;
+    table->count = 0;
+    table->slots = calloc(table->capacity, sizeof(linkSlot));
+    if (table->slots == NULL) {
+        perror("Error allocating link table");
+        exit(1);
+    }
+}
+
+/* Mix both keys into a slot number */
+size_t slotOf(linkTable *table, uint64_t key1, uint64_t key2) {
+    uint64_t h = key1 * 0x9E3779B97F4A7C15ULL ^ key2;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return h & (table->capacity - 1);
+}
+
+/* Slot of the key or the empty slot where it belongs, the lock must be held */
+linkSlot *findSlot(linkTable *table, uint64_t key1, uint64_t key2) {
+    size_t i = slotOf(table, key1, key2);
+    while (table->slots[i].path != NULL && (table->slots[i].key1 != key1 || table->slots[i].key2 != key2)) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return &table->slots[i];
+}
+
+/* Double the table when it is half full, the lock must be held */
+void growTable(linkTable *table) {
+    linkSlot *old = table->slots;
+    size_t oldCapacity = table->capacity;
+    table->capacity *= 2;
+    table->slots = calloc(table->capacity, sizeof(linkSlot));
+    if (table->slots == NULL) {
+        perror("Error allocating link table");
+        exit(1);
+    }
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].path != NULL) {
+            *findSlot(table, old[i].key1, old[i].key2) = old[i];
+        }
+    }
+    free(old);
+}
+
+/* Path stored for the key, or store path and return NULL if the key is new */
+const char *findOrAdd(linkTable *table, uint64_t key1, uint64_t key2, const char *path) {
+    pthread_mutex_lock(&table->lock);
+    linkSlot *slot = findSlot(table, key1, key2);
+    const char *found = slot->path;
+    if (found == NULL && path != NULL) {
+        slot->key1 = key1;
+        slot->key2 = key2;
+        slot->path = strdup(path);
+        if (++table->count * 2 > table->capacity) {
+            growTable(table);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    return found;
+}
+
+/* Free the table and its paths */
+void freeTable(linkTable *table) {
+    for (size_t i = 0; i < table->capacity; i++) {
+        free(table->slots[i].path);
+    }
+    free(table->slots);
+    pthread_mutex_destroy(&table->lock);
+}
+
+/* 64-bit hash of the first size bytes of fd, buffer holds COPY_BUFFER_SIZE bytes */
+uint64_t hashFile(int fd, long size, char *buffer) {
+    uint64_t h = 0xCBF29CE484222325ULL ^ size;
+    long done = 0;
+    ssize_t n;
+    while (done < size && (n = pread(fd, buffer, COPY_BUFFER_SIZE, done)) > 0) {
+        ssize_t i = 0;
+        for (; i + 8 <= n; i += 8) { // Eight bytes per step, memcpy keeps unaligned reads legal
+            uint64_t word;
+            memcpy(&word, buffer + i, 8);
+            h = (h ^ word) * 0x100000001B3ULL;
+            h ^= h >> 31;
+        }
+        for (; i < n; i++) {
+            h = (h ^ (unsigned char)buffer[i]) * 0x100000001B3ULL;
+        }
+        done += n;
+    }
+    return h;
+}
+
+/* Returns 1 if both files hold the same size bytes, buffer holds two COPY_BUFFER_SIZE halves */
+int sameContent(int fd1, int fd2, long size, char *buffer) {
+    long done = 0;
+    while (done < size) {
+        long want = size - done < COPY_BUFFER_SIZE ? size - done : COPY_BUFFER_SIZE;
+        if (pread(fd1, buffer, want, done) != want || pread(fd2, buffer + COPY_BUFFER_SIZE, want, done) != want
+            || memcmp(buffer, buffer + COPY_BUFFER_SIZE, want) != 0) {
+            return 0;
+        }
+        done += want;
+    }
+    return 1;
+}
@@ -0,0 +1,211 @@
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Bounded lock-free queue of buffer items for many producers and consumers
+ * (Vyukov's MPMC ring). Every cell has a sequence number that tells whose
+ * turn it is: a producer may fill cell i at position p when its sequence is p,
+ * a consumer may empty it when its sequence is p + 1. Positions are claimed
+ * with a compare-and-swap, so no lock is taken while the ring is neither
+ * empty nor full. Threads that find it empty or full sleep on a futex. The
+ * other side makes the wake-up system call only when somebody sleeps and no
+ * wake-up is on its way yet, not for every item. Consumers are woken one at
+ * a time, a woken consumer wakes the next one if items are left.
+ */
+
+#define RING_BATCH 16 // Most items a worker takes at once
+
+typedef struct {
+    atomic_size_t sequence;
+    Files item;
+} ringCell;
+
+typedef struct {
+    ringCell *cells;
+    size_t mask; // Capacity - 1, the capacity is a power of two
+    _Alignas(64) atomic_size_t enqueuePos; // Producers and consumers touch different cache lines
+    _Alignas(64) atomic_size_t dequeuePos;
+    _Alignas(64) atomic_int itemEpoch; // Futex word of consumers, changes when an item is added or the workers must look again
+    atomic_int itemSleepers; // Consumers sleeping or about to sleep
+    atomic_int itemWakePending; // A consumer was woken and did not run yet
+    atomic_int spaceEpoch; // Futex word of producers, changes when an item is removed
+    atomic_int spaceSleeping;
+} Ring;
+
+/* Allocate a ring of at least size cells */
+void ringInit(Ring *ring, int size) {
+    size_t capacity = 2;
+    while (capacity < (size_t)size) {
+        capacity *= 2;
+    }
+    ring->cells = malloc(sizeof(ringCell) * capacity);
+    if (ring->cells == NULL) {
+        perror("Error allocating ring");
+        exit(1);
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->enqueuePos, 0);
+    atomic_init(&ring->dequeuePos, 0);
+    atomic_init(&ring->itemEpoch, 0);
+    atomic_init(&ring->itemSleepers, 0);
+    atomic_init(&ring->itemWakePending, 0);
+    atomic_init(&ring->spaceEpoch, 0);
+    atomic_init(&ring->spaceSleeping, 0);
+}
+
+/* Sleep until *word is no longer value, a wake-up or the timeout in milliseconds */
+void futexWait(atomic_int *word, int value, int milliseconds) {
+    struct timespec timeout = {milliseconds / 1000, (milliseconds % 1000) * 1000000L};
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, &timeout, NULL, 0);
+}
+
+/* Change the futex word and wake up to count sleepers */
+void futexWake(atomic_int *word, int count) {
+    atomic_fetch_add(word, 1);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Add an item if there is room, returns 0 if the ring is full */
+int ringTryPush(Ring *ring, Files *item) {
+    size_t pos = atomic_load_explicit(&ring->enqueuePos, memory_order_relaxed);
+    while (1) {
+        ringCell *cell = &ring->cells[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        long diff = (long)(sequence - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->item = *item;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // The consumer of the previous round has not emptied it yet
+        } else {
+            pos = atomic_load_explicit(&ring->enqueuePos, memory_order_relaxed);
+        }
+    }
+}
+
+/* Take up to max consecutive items, returns how many were taken */
+int ringTryPopBatch(Ring *ring, Files *items, int max) {
+    size_t pos = atomic_load_explicit(&ring->dequeuePos, memory_order_relaxed);
+    while (1) {
+        int ready = 0;
+        while (ready < max) {
+            ringCell *cell = &ring->cells[(pos + ready) & ring->mask];
+            if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + ready + 1) {
+                break;
+            }
+            ready++;
+        }
+        if (ready == 0) {
+            ringCell *cell = &ring->cells[pos & ring->mask];
+            long diff = (long)(atomic_load_explicit(&cell->sequence, memory_order_acquire) - (pos + 1));
+            if (diff < 0) {
+                return 0; // Empty
+            }
+            pos = atomic_load_explicit(&ring->dequeuePos, memory_order_relaxed); // Another consumer took it
+            continue;
+        }
+        // Claim all ready cells at once, they are only reused after their sequence moves on
+        if (atomic_compare_exchange_weak_explicit(&ring->dequeuePos, &pos, pos + ready, memory_order_relaxed, memory_order_relaxed)) {
+            for (int i = 0; i < ready; i++) {
+                ringCell *cell = &ring->cells[(pos + i) & ring->mask];
+                items[i] = cell->item;
+                atomic_store_explicit(&cell->sequence, pos + i + ring->mask + 1, memory_order_release);
+            }
+            return ready;
+        }
+    }
+}
+
+/* Number of items in the ring, exact only while nobody pushes or pops */
+long ringCount(Ring *ring) {
+    return (long)(atomic_load(&ring->enqueuePos) - atomic_load(&ring->dequeuePos));
+}
+
+/* Items a consumer may take at once when consumers share the ring, between 1 and RING_BATCH. A batch stays
+   with the consumer that took it, so it takes no more than its share and the others are not left idle */
+int ringBatchSize(Ring *ring, int consumers) {
+    long share = ringCount(ring) / consumers;
+    return share < 1 ? 1 : share > RING_BATCH ? RING_BATCH : share;
+}
+
+/* Wake one sleeping consumer unless a wake-up is already on its way */
+void ringWakeOne(Ring *ring) {
+    atomic_thread_fence(memory_order_seq_cst); // Publish the items before looking for sleepers
+    if (atomic_load(&ring->itemSleepers) > 0 && !atomic_load_explicit(&ring->itemWakePending, memory_order_relaxed)
+        && !atomic_exchange(&ring->itemWakePending, 1)) {
+        futexWake(&ring->itemEpoch, 1);
+    }
+}
+
+/* Add an item, sleeps while the ring is full, returns 0 if *stop was set first */
+int ringPush(Ring *ring, Files *item, int *stop) {
+    while (!ringTryPush(ring, item)) {
+        if (*stop) {
+            return 0;
+        }
+        atomic_store(&ring->spaceSleeping, 1); // Seen by a consumer that removes an item after this point
+        int epoch = atomic_load(&ring->spaceEpoch);
+        if (!ringTryPush(ring, item)) {
+            futexWait(&ring->spaceEpoch, epoch, 100); // SIGINT cannot wake a futex, look at *stop every 100 ms
+            continue;
+        }
+        break;
+    }
+    ringWakeOne(ring);
+    return 1;
+}
+
+/* Take up to max items without sleeping, wakes a producer waiting for room and the next consumer if items are left */
+int ringPopBatch(Ring *ring, Files *items, int max) {
+    int n = ringTryPopBatch(ring, items, max);
+    if (n > 0) {
+        if (ringCount(ring) > 0) {
+            ringWakeOne(ring);
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&ring->spaceSleeping, memory_order_relaxed) && atomic_exchange(&ring->spaceSleeping, 0)) {
+            futexWake(&ring->spaceEpoch, INT_MAX);
+        }
+    }
+    return n;
+}
+
+/* Announce that the caller will sleep, returns the epoch to pass to ringSleep after looking for work again */
+int ringPrepareSleep(Ring *ring) {
+    atomic_fetch_add(&ring->itemSleepers, 1);
+    return atomic_load(&ring->itemEpoch);
+}
+
+/* Sleep until an item is added, ringWakeAll is called or 100 ms passed, sleep is 0 if work was found after ringPrepareSleep */
+void ringSleep(Ring *ring, int epoch, int sleep) {
+    if (sleep) {
+        futexWait(&ring->itemEpoch, epoch, 100);
+    }
+    atomic_fetch_sub(&ring->itemSleepers, 1);
+    atomic_store(&ring->itemWakePending, 0); // The next item may wake another consumer
+}
+
+/* Wake every consumer, so they look at the ring and the other work again */
+void ringWakeAll(Ring *ring) {
+    futexWake(&ring->itemEpoch, INT_MAX);
+}
+
+/* Take one item left in the ring, for the clean up after SIGINT */
+int ringDrain(Ring *ring, Files *item) {
+    return ringTryPopBatch(ring, item, 1);
+}
+
+/* Free the cells of the ring */
+void ringDestroy(Ring *ring) {
+    free(ring->cells);
+}
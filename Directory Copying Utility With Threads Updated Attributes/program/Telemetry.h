@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Counters and per-file log of the workers. Every worker owns one
+ * workerStats and is the only thread that changes it, so counting a file
+ * takes no lock and touches no cache line of another worker; the reporter
+ * thread only reads them. Per-file lines are appended to a log buffer under
+ * its own short lock and written out by the reporter, so no worker waits
+ * for the terminal while it holds a lock the others need.
+ */
+
+#define LOG_BUFFER (256 * 1024) // Bytes of log lines a worker can add before the reporter writes them
+
+typedef struct {
+    _Alignas(64) atomic_long bytes; // Written by the worker, read by the reporter while it runs
+    atomic_long files;
+    atomic_long busyNs; // Time copying
+    atomic_long idleNs; // Time waiting for an item
+    long methodFiles[COPY_METHODS]; // Read only after the worker was joined
+    long methodBytes[COPY_METHODS];
+} workerStats;
+
+workerStats *telemetry; // One for each worker
+__thread workerStats *myStats; // Counters of the calling worker
+
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t logReady = PTHREAD_COND_INITIALIZER; // Signaled when the log buffer is half full
+pthread_cond_t logSpace = PTHREAD_COND_INITIALIZER; // Signaled when the reporter took the log buffer
+char *logBuffers[2];
+int logActive = 0; // Buffer the workers append to, the reporter writes the other one
+size_t logUsed = 0;
+
+/* Monotonic time in nanoseconds */
+long nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/* Allocate the counters of count workers and the log buffers */
+void initTelemetry(int count) {
+    if (posix_memalign((void **)&telemetry, 64, sizeof(workerStats) * count) != 0) {
+        perror("Error allocating worker counters");
+        exit(1);
+    }
+    memset(telemetry, 0, sizeof(workerStats) * count);
+    logBuffers[0] = malloc(LOG_BUFFER);
+    logBuffers[1] = malloc(LOG_BUFFER);
+    if (logBuffers[0] == NULL || logBuffers[1] == NULL) {
+        perror("Error allocating log buffer");
+        exit(1);
+    }
+}
+
+/* Add bytes written to the counters of the calling worker, a chunk counts as soon as it is copied */
+void countBytes(long bytes) {
+    atomic_fetch_add_explicit(&myStats->bytes, bytes > 0 ? bytes : 0, memory_order_relaxed);
+}
+
+/* Add a copied file to the counters of the calling worker, with its bytes unless countBytes added them chunk by chunk */
+void countFile(long bytes, int method, int chunked) {
+    bytes = bytes > 0 ? bytes : 0;
+    if (!chunked) {
+        countBytes(bytes);
+    }
+    atomic_fetch_add_explicit(&myStats->files, 1, memory_order_relaxed);
+    myStats->methodFiles[method]++;
+    myStats->methodBytes[method] += bytes;
+}
+
+/* Add the time since *mark to the busy or idle time of the calling worker and move *mark to now */
+void account(long *mark, int idle) {
+    long now = nowNs();
+    atomic_fetch_add_explicit(idle ? &myStats->idleNs : &myStats->busyNs, now - *mark, memory_order_relaxed);
+    *mark = now;
+}
+
+/* Append a line to the log, waits only if the reporter is a whole buffer behind */
+void logLine(const char *format, ...) {
+    char line[3 * PATH_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length >= (int)sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    pthread_mutex_lock(&logLock);
+    while (logUsed + length > LOG_BUFFER) {
+        pthread_cond_signal(&logReady);
+        pthread_cond_wait(&logSpace, &logLock);
+    }
+    memcpy(logBuffers[logActive] + logUsed, line, length);
+    logUsed += length;
+    if (logUsed > LOG_BUFFER / 2) {
+        pthread_cond_signal(&logReady);
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+/* Wait until the log buffer is half full, *stop is set or milliseconds passed */
+void logWait(int milliseconds, atomic_int *stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += milliseconds / 1000;
+    deadline.tv_nsec += (milliseconds % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&logLock);
+    if (logUsed <= LOG_BUFFER / 2 && !atomic_load(stop)) {
+        pthread_cond_timedwait(&logReady, &logLock, &deadline);
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+/* Set *stop and wake the reporter, so it does not finish its wait first */
+void logStop(atomic_int *stop) {
+    pthread_mutex_lock(&logLock);
+    atomic_store(stop, 1);
+    pthread_cond_signal(&logReady);
+    pthread_mutex_unlock(&logLock);
+}
+
+/* Swap the log buffers and write the full one, only the reporter calls it */
+void logFlush(FILE *out) {
+    pthread_mutex_lock(&logLock);
+    char *full = logBuffers[logActive];
+    size_t used = logUsed;
+    logActive ^= 1;
+    logUsed = 0;
+    pthread_cond_broadcast(&logSpace);
+    pthread_mutex_unlock(&logLock);
+    if (used > 0) {
+        fwrite(full, 1, used, out);
+        fflush(out);
+    }
+}
+
+/* Free the counters and the log buffers */
+void freeTelemetry() {
+    free(telemetry);
+    free(logBuffers[0]);
+    free(logBuffers[1]);
+}
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring for the --engine uring workers, made with the system
+ * calls directly so no library is needed. One ring per worker: the worker
+ * fills submission entries, io_uring_enter hands them to the kernel and
+ * waits, completions are read back from the completion ring.
+ */
+
+#define URING_DEPTH 128 // Submission entries, the kernel makes twice as many completion entries
+#define URING_FILES 8 // Files a worker keeps in flight
+#define URING_SLOTS 16 // Registered buffers of a worker, one per read->write pair in flight
+#define URING_BLOCK (256 * 1024) // Size of a registered buffer
+
+typedef struct {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned queued; // Entries filled since the last io_uring_enter
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+} uring;
+
+/* Set up a ring, returns 0 if the kernel has no io_uring or does not allow it */
+int uringInit(uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(uring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return 0;
+    }
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqMapSize > ring->sqMapSize) {
+            ring->sqMapSize = ring->cqMapSize;
+        }
+        ring->cqMapSize = ring->sqMapSize;
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        close(ring->fd);
+        return 0;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) {
+            munmap(ring->sqMap, ring->sqMapSize);
+            close(ring->fd);
+            return 0;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqMap != ring->sqMap) {
+            munmap(ring->cqMap, ring->cqMapSize);
+        }
+        munmap(ring->sqMap, ring->sqMapSize);
+        close(ring->fd);
+        return 0;
+    }
+    char *sq = ring->sqMap, *cq = ring->cqMap;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 1;
+}
+
+/* Hand the filled entries to the kernel and wait for at least wait completions, returns -1 on error */
+int uringSubmit(uring *ring, unsigned wait) {
+    while (1) {
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            ring->queued -= n;
+            return n;
+        }
+        if (errno != EINTR) {
+            perror("Error submitting to io_uring");
+            return -1;
+        }
+    }
+}
+
+/* Next free submission entry, cleared, submits first when the ring is full */
+struct io_uring_sqe *uringSqe(uring *ring) {
+    unsigned tail = *ring->sqTail;
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqMask) {
+        uringSubmit(ring, 0);
+    }
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE); // The kernel reads it on the next io_uring_enter
+    ring->queued++;
+    return sqe;
+}
+
+/* Take one completion if there is one, returns 0 if the completion ring is empty */
+int uringPeek(uring *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *cqe = ring->cqes[head & ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Register buffers for IORING_OP_READ_FIXED/WRITE_FIXED, returns 0 if the kernel refused */
+int uringRegisterBuffers(uring *ring, struct iovec *buffers, unsigned count) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+}
+
+/* Unmap the ring and close it, the kernel cancels what is still in flight */
+void uringExit(uring *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+}
+
+// Operations of a uring worker, kept in the user data of an entry with the file and the buffer
+#define URING_OPEN_SRC 1
+#define URING_OPEN_DEST 2
+#define URING_STATX 3
+#define URING_READ 4
+#define URING_WRITE 5
+#define URING_CLOSE 6
+
+// File a uring worker has in flight
+typedef struct {
+    Files item;
+    int active;
+    int pending; // Opens, statx or closes not completed yet
+    int failed; // An operation failed, the file is copied again with the synchronous engine
+    int copying; // Both files are open, blocks are copied
+    int closing;
+    struct statx stx;
+    long size;
+    long next; // Offset of the next block to read
+    long written;
+    int blocks; // read->write pairs in flight
+} uringFile;
+
+/* User data of an entry */
+unsigned long long uringData(int file, int op, int slot) {
+    return ((unsigned long long)file << 32) | ((unsigned long long)op << 16) | slot;
+}
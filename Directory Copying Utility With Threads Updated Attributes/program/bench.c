@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "utility.h"
+#include "Ring.h"
+
+/*
+ * Queue benchmark of MWCp. Producers add empty items and consumers remove
+ * them, first through the mutex and condition variable Buffer of main.c,
+ * then through the ring one item at a time and in batches like the workers
+ * take them. Results are printed as CSV, one line per queue and thread count.
+ * The spread check queues a few slow items at once and fails if batching
+ * leaves a consumer without any of them.
+ * Usage: ./queuebench [items] [bufferSize]
+ */
+
+#define QUEUE_BUFFER 0
+#define QUEUE_RING 1
+#define QUEUE_RING_BATCH 2
+
+const char *queueNames[] = {"buffer", "ring", "ring-batch"};
+
+int queueKind;
+long totalItems;
+long itemsPerProducer;
+atomic_long consumed; // Items removed by all consumers
+int stopFlag = 0;
+int consumerCount; // Consumers of the current run
+Ring ring;
+
+/* add_item of main.c */
+void bufferAdd(Files item) {
+    pthread_mutex_lock(&the_mutex);
+    while (buffer.count == buffer.bufferSize) pthread_cond_wait(&condp, &the_mutex);
+    buffer.buffer[buffer.last] = item;
+    buffer.last = (buffer.last + 1) % buffer.bufferSize;
+    buffer.count++;
+    pthread_cond_signal(&condc);
+    pthread_mutex_unlock(&the_mutex);
+}
+
+/* remove_item of main.c, returns 0 when every item was removed */
+int bufferRemove(Files *item) {
+    pthread_mutex_lock(&the_mutex);
+    while (buffer.count == 0 && atomic_load(&consumed) < totalItems) pthread_cond_wait(&condc, &the_mutex);
+    if (buffer.count == 0) {
+        pthread_mutex_unlock(&the_mutex);
+        return 0;
+    }
+    *item = buffer.buffer[buffer.head];
+    buffer.head = (buffer.head + 1) % buffer.bufferSize;
+    buffer.count--;
+    if (atomic_fetch_add(&consumed, 1) + 1 == totalItems) {
+        pthread_cond_broadcast(&condc); // Let the other consumers leave
+    }
+    pthread_cond_signal(&condp);
+    pthread_mutex_unlock(&the_mutex);
+    return 1;
+}
+
+void* producer(void* arg) {
+    Files item = {0};
+    for (long i = 0; i < itemsPerProducer; i++) {
+        item.offset = i;
+        if (queueKind == QUEUE_BUFFER) {
+            bufferAdd(item);
+        } else {
+            ringPush(&ring, &item, &stopFlag);
+        }
+    }
+    return NULL;
+}
+
+void* consumer(void* arg) {
+    Files items[RING_BATCH];
+    long sum = 0;
+    if (queueKind == QUEUE_BUFFER) {
+        while (bufferRemove(&items[0])) {
+            sum += items[0].offset;
+        }
+        return (void *)sum;
+    }
+    while (atomic_load(&consumed) < totalItems) {
+        int n = ringPopBatch(&ring, items, queueKind == QUEUE_RING_BATCH ? ringBatchSize(&ring, consumerCount) : 1);
+        if (n > 0) {
+            for (int i = 0; i < n; i++) {
+                sum += items[i].offset;
+            }
+            if (atomic_fetch_add(&consumed, n) + n == totalItems) {
+                ringWakeAll(&ring);
+            }
+            continue;
+        }
+        // Same parking as the workers of main.c
+        int epoch = ringPrepareSleep(&ring);
+        ringSleep(&ring, epoch, ringCount(&ring) == 0 && atomic_load(&consumed) < totalItems);
+    }
+    return (void *)sum;
+}
+
+/* Move totalItems through the queue, returns the elapsed seconds */
+double run(int kind, int producers, int consumers, int bufferSize) {
+    pthread_t threads[producers + consumers];
+    struct timespec start, end;
+
+    queueKind = kind;
+    consumerCount = consumers;
+    itemsPerProducer = totalItems / producers;
+    totalItems = itemsPerProducer * producers;
+    atomic_store(&consumed, 0);
+    initBuffer(bufferSize);
+    ringInit(&ring, bufferSize);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, consumer, NULL);
+    }
+    for (int i = 0; i < producers; i++) {
+        pthread_create(&threads[consumers + i], NULL, producer, NULL);
+    }
+    long sum = 0;
+    for (int i = 0; i < producers + consumers; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        sum += (long)result;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Every item must arrive exactly once
+    if (sum != producers * (itemsPerProducer * (itemsPerProducer - 1) / 2)) {
+        fprintf(stderr, "%s lost items\n", queueNames[kind]);
+        exit(1);
+    }
+    free(buffer.buffer);
+    ringDestroy(&ring);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Consumer of the spread check, every item takes a millisecond like a file copy, returns how many it took */
+void* slowConsumer(void* arg) {
+    Files items[RING_BATCH];
+    struct timespec copy = {0, 1000000};
+    long taken = 0;
+    while (atomic_load(&consumed) < totalItems) {
+        int n = ringPopBatch(&ring, items, ringBatchSize(&ring, consumerCount));
+        if (n > 0) {
+            for (int i = 0; i < n; i++) {
+                nanosleep(&copy, NULL);
+            }
+            taken += n;
+            if (atomic_fetch_add(&consumed, n) + n == totalItems) {
+                ringWakeAll(&ring);
+            }
+            continue;
+        }
+        int epoch = ringPrepareSleep(&ring);
+        ringSleep(&ring, epoch, ringCount(&ring) == 0 && atomic_load(&consumed) < totalItems);
+    }
+    return (void *)taken;
+}
+
+/* Queue the slow items at once for the consumers, returns 0 if a consumer got none of them */
+int spreadCheck(int consumers, int items) {
+    pthread_t threads[consumers];
+    Files item = {0};
+    int spread = 1;
+
+    totalItems = items;
+    consumerCount = consumers;
+    atomic_store(&consumed, 0);
+    ringInit(&ring, items);
+    for (int i = 0; i < items; i++) {
+        ringPush(&ring, &item, &stopFlag);
+    }
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, slowConsumer, NULL);
+    }
+    printf("spread,%d,%d,", consumers, items);
+    for (int i = 0; i < consumers; i++) {
+        void *taken;
+        pthread_join(threads[i], &taken);
+        printf("%s%ld", i == 0 ? "" : "/", (long)taken);
+        spread &= (long)taken > 0;
+    }
+    printf("\n");
+    ringDestroy(&ring);
+    return spread;
+}
+
+int main(int argc, char *argv[]) {
+    long items = argc > 1 ? atol(argv[1]) : 2000000;
+    int bufferSize = argc > 2 ? atoi(argv[2]) : 1024;
+    static const int threadCounts[][2] = {{1, 1}, {1, 4}, {1, 16}, {4, 4}, {4, 64}};
+
+    pthread_mutex_init(&the_mutex, NULL);
+    pthread_cond_init(&condc, NULL);
+    pthread_cond_init(&condp, NULL);
+    printf("queue,producers,consumers,items,seconds,items_per_sec\n");
+    for (int t = 0; t < (int)(sizeof(threadCounts) / sizeof(threadCounts[0])); t++) {
+        for (int kind = QUEUE_BUFFER; kind <= QUEUE_RING_BATCH; kind++) {
+            totalItems = items;
+            double seconds = run(kind, threadCounts[t][0], threadCounts[t][1], bufferSize);
+            printf("%s,%d,%d,%ld,%.3f,%.0f\n", queueNames[kind], threadCounts[t][0], threadCounts[t][1], totalItems, seconds, totalItems / seconds);
+        }
+    }
+    printf("check,consumers,items,taken\n");
+    if (!spreadCheck(4, 12) || !spreadCheck(16, 64)) {
+        fprintf(stderr, "ring batches left a consumer idle\n");
+        return 1;
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -8,30 +9,168 @@
 #include <fcntl.h>
 #include <time.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include "CopyEngine.h"
+#include "Ring.h"
+#include "Links.h"
+#include "Uring.h"
+#include "Telemetry.h"
+#include "Journal.h"
 
 /* Manager thread function */
 void* manager(void* arg);
 
-/* Create directory structure */
-void createDirectory(const char* srcDirPath, const char* destDirPath);
+/* Walker thread function, copies directories from its deque or steals them */
+void* walker(void* arg);
+
+/* Create the entries of one directory and queue its files and subdirectories */
+void createDirectory(dirHandle *dir, int self);
 
 /* Worker thread function */
 void* worker(void* arg);
 
+/* Copy the small files of a pack, all reads first and then all writes */
+void copyPack(Files *item, char *copyBuffer);
+
+/* Queue the small files collected by a walker as one item */
+void queuePack(dirHandle *dir, filePack *pack);
+
+/* Reporter thread function, writes the per-file log and the progress */
+void* reporter(void* arg);
+
+/* Print the progress line and the JSON record of the counters at now */
+void report(long now, int final);
+
+/* Path of a destination file relative to the destination directory, the key of its journal records */
+void journalPath(dirHandle *dir, const char *name, char *path, size_t size);
+
+/* Add a copied file to the journal with the size and modification time its source had when it was opened */
+void journalFile(dirHandle *dir, const char *name, struct stat *srcStat);
+
+/* Worker thread of --engine uring, keeps several files in flight on its own io_uring */
+void* uringWorker(void* arg);
+
+/* Copy a whole opened file with the synchronous engine, close it and count it */
+void copyWhole(Files *item, struct stat *statBuf, int reflinked, char *copyBuffer);
+
+/* A taken file will not be split, let the workers leave when it was the last one */
+void notSplit();
+
 /* Add item to buffer */
 void add_item(Files item);
 
 /* Remove item from buffer */
 Files remove_item();
 
+/* Remove item from the ring, in batches kept by the calling worker */
+Files removeRingItem();
+
+/* Take a batch of items from the ring into ringBatch, returns how many */
+int refillBatch();
+
+/* Take an item without waiting, returns 0 if the queue is empty */
+int tryRemoveItem(Files *item);
+
+/* Take the next chunk of the first split job, the_mutex must be held */
+Files takeChunk();
+
+/* Wake the workers waiting for items, the_mutex must be held */
+void wakeWorkers();
+
+/* Number of files waiting in the buffer or the ring */
+long queuedItems();
+
+/* Split a large file into chunks other workers can take, returns its job */
+fileJob* splitFile(Files *item, struct stat *statBuf);
+
+/* Open a file of the buffer relative to its directory, returns 0 if it cannot be copied */
+int openItem(Files *item);
+
+/* Returns 1 if the destination has the size and modification time of the source, so --sync can skip it */
+int unchanged(dirHandle *dir, const char *name, struct stat *srcStat);
+
+/* Delete the destination entries of a directory whose names are not in names */
+void deleteExtra(dirHandle *dir, char **names, int count);
+
+/* Delete a destination file or directory tree */
+void removeEntry(int dirFd, const char *name);
+
+/* Remove a destination file that shares its inode with other names, so copying into it leaves them alone */
+void breakLink(dirHandle *dir, const char *name);
+
+/* Link a destination file to the destination of an earlier link of the same source inode */
+int linkDestination(const char *target, dirHandle *dir, const char *name);
+
+/* Reflink or link the file to an earlier copy with the same content, returns 1 if it was deduplicated */
+int dedupFile(Files *item, long size, char *buffer, uint64_t *hash);
+
+/* Give the destination the modification time of the source, the next --sync compares it */
+void keepTimes(int srcFd, int destFd);
+
+/* Count a copied file, journal it with the status of its source from before the copy, print it and release its directory.
+   The bytes of a chunked file were counted by the workers that copied its chunks */
+void fileCopied(dirHandle *dir, char *name, long bytes, int method, struct stat *srcStat, int chunked);
+
 int *maxBuffer; // Maximum buffer size
-int fileCount = 0; // Number of regular files
-int dirCount = 0; // Number of directories
-int fifoCount = 0; // Number of FIFO files
-int activeWorker = 0; // Number of active workers
-int wait = 0; // Wait flag
+atomic_int fileCount = 0; // Number of regular files
+atomic_int dirCount = 0; // Number of directories
+atomic_int fifoCount = 0; // Number of FIFO files
 int numberOfWorkers = 0; // Number of workers
-long totalBytes = 0; // Total bytes copied
+long totalBytes = 0; // Total bytes copied, summed from the worker counters at the end
+long chunkThreshold = 256L * 1024 * 1024; // Files above this size are copied in chunks by several workers, 0 turns it off
+long chunkSize = 64L * 1024 * 1024; // Size of one chunk
+int splitCount = 0; // Number of files copied in chunks
+int syncMode = 0; // --sync, skip files whose size and modification time did not change
+int blockSync = 0; // --blocks, rewrite only the changed blocks of files that are copied
+int deleteMode = 0; // --delete, remove destination entries that are not in the source
+atomic_int skippedCount = 0; // Unchanged files
+atomic_long skippedBytes = 0;
+atomic_int deletedCount = 0; // Destination entries removed by --delete
+int hardlinks = 0; // --hardlinks, link files that are links of one source inode instead of copying them again
+int dedupMode = 0; // --dedup reflinks files with the content of an earlier copy, --dedup-link links them
+linkTable inodeTable; // (st_dev, st_ino) of the first link of a source inode -> its destination
+linkTable contentTable; // (size, hash) of a copied file -> its destination
+atomic_int linkCount = 0; // Hard links created by --hardlinks
+atomic_int dedupCount = 0; // Files deduplicated by --dedup
+atomic_long dedupBytes = 0;
+atomic_long logicalBytes = 0; // Sizes of the copied files, holes included
+atomic_int sparseCount = 0; // Copied files with holes
+int walkerCount = 0; // Number of walker threads, the number of workers unless --walkers is given
+taskDeque *deques; // One deque of directories for each walker
+dirHandle *rootDir; // Source and destination directories of the command line
+atomic_int pendingDirs = 0; // Directories queued or being read
+atomic_int queuedDirs = 0; // Directories waiting in a deque
+atomic_int idleWalkers = 0; // Walkers waiting on walkCond
+pthread_mutex_t walkMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t walkCond = PTHREAD_COND_INITIALIZER; // Signaled when a directory is queued or the last one is done
+int useRing = 1; // Queue files in the lock-free ring, --queue buffer uses the mutex and condition variables
+Ring itemRing;
+__thread Files ringBatch[RING_BATCH]; // Items a worker took from the ring and did not copy yet
+__thread int batchCount = 0;
+__thread int batchNext = 0;
+int useUring = 0; // --engine uring
+int packFiles = PACK_FILES; // Small files of a directory in one item, --pack 0 queues every file alone
+int quiet = 0; // --quiet, no line for every copied file
+int showProgress = 0; // --progress, refresh a progress line on stderr
+FILE *jsonOut = NULL; // --json, one record of the counters every interval
+long reportInterval = 1000; // --interval, milliseconds between progress lines and records
+atomic_int reportDone = 0; // Every worker was joined, the reporter writes the rest and leaves
+atomic_int foundFiles = 0; // Files handed to the workers, for the ETA
+atomic_long foundBytes = 0;
+atomic_int unsizedFiles = 0; // Found files the walker did not stat, the ETA counts files then
+long startNs; // Start of the copy
+long queueSamples = 0, queueSum = 0, queueMax = 0; // Queue depth seen by the reporter
+int journalMode = 0; // --journal, record the copied files and chunks in the destination
+int resumeMode = 0; // --resume, skip the files and chunks in the journal of an interrupted run
+linkTable journalTable; // Records of the journal that is resumed
+int journalDirFd = -1; // Destination directory of the journal, synced before each batch
+size_t rootPathLength; // Length of the destination path of the command line, rootDir is freed before the workers finish
+long journalInterval = 2000; // --journal-sync, milliseconds between journal commits
+atomic_int resumedCount = 0; // Files skipped because the journal has them
+atomic_long resumedBytes = 0;
+atomic_int revalidatedCount = 0; // Destinations without a record that were compared block by block
+atomic_int failedCount = 0; // Files whose destination could not be written completely, the exit status is 1
 
 
 int sigInt = 0;
@@ -47,7 +186,101 @@ long convertTicksToMilliseconds(clock_t ticks) {
 
 int main(int argc, char *argv[]) {
     if (argc < 5) {
-        printf("Usage: %s <bufferSize> <numberOfWorkers> <sourceDirectory> <destinationDirectory>\n", argv[0]);
+        printf("Usage: %s <bufferSize> <numberOfWorkers> <sourceDirectory> <destinationDirectory> [--chunk-threshold <MB>] [--chunk-size <MB>] [--walkers <n>] [--queue ring|buffer] [--sync] [--blocks] [--delete] [--hardlinks] [--dedup|--dedup-link] [--engine sync|uring] [--pack <files>] [--quiet] [--progress] [--json <file>] [--interval <ms>] [--journal|--resume] [--journal-sync <ms>]\n", argv[0]);
+        return 1;
+    }
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--chunk-threshold") == 0 && i + 1 < argc) {
+            chunkThreshold = atol(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+            chunkSize = atol(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--walkers") == 0 && i + 1 < argc) {
+            walkerCount = atoi(argv[++i]);
+            if (walkerCount < 1) {
+                printf("Number of walkers must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--sync") == 0) {
+            syncMode = 1;
+        } else if (strcmp(argv[i], "--blocks") == 0) {
+            syncMode = 1;
+            blockSync = 1;
+        } else if (strcmp(argv[i], "--delete") == 0) {
+            deleteMode = 1;
+        } else if (strcmp(argv[i], "--hardlinks") == 0) {
+            hardlinks = 1;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedupMode = 1;
+        } else if (strcmp(argv[i], "--dedup-link") == 0) {
+            dedupMode = 2;
+        } else if (strcmp(argv[i], "--journal") == 0) {
+            journalMode = 1;
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            journalMode = 1; // The resumed run goes on with the same journal
+            resumeMode = 1;
+        } else if (strcmp(argv[i], "--journal-sync") == 0 && i + 1 < argc) {
+            journalInterval = atol(argv[++i]);
+            if (journalInterval <= 0) {
+                printf("Journal sync interval must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            quiet = 1;
+        } else if (strcmp(argv[i], "--progress") == 0) {
+            showProgress = 1;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            i++;
+            jsonOut = strcmp(argv[i], "-") == 0 ? stdout : fopen(argv[i], "w");
+            if (jsonOut == NULL) {
+                perror("Error opening JSON file");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            reportInterval = atol(argv[++i]);
+            if (reportInterval <= 0) {
+                printf("Interval must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {
+            packFiles = atoi(argv[++i]);
+            if (packFiles < 0 || packFiles > PACK_FILES) {
+                printf("Files per pack must be between 0 and %d\n", PACK_FILES);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "uring") == 0) {
+                useUring = 1;
+            } else if (strcmp(argv[i], "sync") == 0) {
+                useUring = 0;
+            } else {
+                printf("Unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "ring") == 0) {
+                useRing = 1;
+            } else if (strcmp(argv[i], "buffer") == 0) {
+                useRing = 0;
+            } else {
+                printf("Unknown queue %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (useUring && (blockSync || dedupMode)) {
+        printf("--blocks and --dedup compare files, they use the sync engine\n");
+        useUring = 0;
+    }
+    if (useUring) {
+        chunkThreshold = 0; // A uring worker keeps many blocks of a large file in flight itself
+    }
+    if (chunkThreshold < 0 || chunkSize <= 0) {
+        printf("Chunk threshold and size must be positive\n");
         return 1;
     }
     int s;
@@ -66,11 +299,40 @@ int main(int argc, char *argv[]) {
 
     int bufferSize = atoi(argv[1]);
     numberOfWorkers = atoi(argv[2]);
-    activeWorker = numberOfWorkers;
+    if (walkerCount == 0) {
+        walkerCount = numberOfWorkers;
+    }
+    // Each directory handle takes two descriptors, keep two for every worker and some for stdio and the walkers' readdir
+    struct rlimit fileLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur != RLIM_INFINITY) {
+        dirLimit = ((long)fileLimit.rlim_cur - 2 * numberOfWorkers - walkerCount - 16) / 2;
+    } else {
+        dirLimit = 1 << 20;
+    }
+    if (dirLimit < walkerCount) {
+        dirLimit = walkerCount;
+    }
 
     maxBuffer = (int*)malloc(sizeof(int)); // Allocate memory for maxBuffer
     *maxBuffer = bufferSize;
     initBuffer(bufferSize); // Initialize buffer
+    initTable(&inodeTable);
+    initTable(&contentTable);
+    initTelemetry(numberOfWorkers);
+    if (journalMode) {
+        initTable(&journalTable);
+        journalDirFd = open(argv[4], O_RDONLY | O_DIRECTORY);
+        if (journalDirFd == -1) {
+            perror("Error opening destination directory");
+            exit(1);
+        }
+        if (!journalOpen(journalDirFd, resumeMode, &journalTable)) {
+            exit(1);
+        }
+    }
+    if (useRing) {
+        ringInit(&itemRing, bufferSize);
+    }
 
     if(sigInt == 1) {
         clean();
@@ -79,6 +341,7 @@ int main(int argc, char *argv[]) {
     }
 
     pthread_t managerThread;
+    pthread_t reporterThread;
     pthread_t workerThreads[numberOfWorkers];
 
     s = pthread_mutex_init(&the_mutex, 0);
@@ -101,9 +364,14 @@ int main(int argc, char *argv[]) {
         printf("Error creating condition variable\n");
         return 1;
     }
-    s = pthread_barrier_init(&workerBarrier, NULL, numberOfWorkers);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    startNs = nowNs();
+
+    s = pthread_create(&reporterThread, NULL, reporter, NULL);
     if (s != 0) {
-        printf("Error creating barrier variable\n");
+        printf("Error creating reporter thread\n");
         return 1;
     }
 
@@ -114,16 +382,13 @@ int main(int argc, char *argv[]) {
     }
 
     for (int i = 0; i < numberOfWorkers; i++) { // Create worker threads
-        s = pthread_create(&workerThreads[i], NULL, worker, NULL);
+        s = pthread_create(&workerThreads[i], NULL, useUring ? uringWorker : worker, (void *)(intptr_t)i);
         if (s != 0) {
             printf("Error creating worker thread\n");
             return 1;
         }
     }
 
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    
     // Wait for threads to finish
     s = pthread_join(managerThread, NULL);
     if (s != 0) {
@@ -137,6 +402,8 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
+    logStop(&reportDone);
+    pthread_join(reporterThread, NULL);
 
     clock_gettime(CLOCK_MONOTONIC, &end);
     // Calculate elapsed time
@@ -146,46 +413,365 @@ int main(int argc, char *argv[]) {
     long miliseconds = elapsedMilliseconds % 1000;
 
     printf("\n---------------STATISTICS--------------------\n");
-    printf("Consumers: %d - Buffer Size: %d\n", numberOfWorkers, bufferSize);
-    printf("Number of Regular File: %d\n", fileCount);
-    printf("Number of FIFO File: %d\n", fifoCount);
-    printf("Number of Directory: %d\n", dirCount);
+    printf("Consumers: %d - Walkers: %d - Buffer Size: %d - Queue: %s\n", numberOfWorkers, walkerCount, bufferSize, useRing ? "ring" : "buffer");
+    printf("Number of Regular File: %d\n", atomic_load(&fileCount));
+    printf("Number of File Copied in Chunks: %d\n", splitCount);
+    printf("Number of FIFO File: %d\n", atomic_load(&fifoCount));
+    printf("Number of Directory: %d\n", atomic_load(&dirCount));
+    if (syncMode) {
+        printf("Number of Unchanged File Skipped: %d - %ld bytes\n", atomic_load(&skippedCount), atomic_load(&skippedBytes));
+    }
+    if (deleteMode) {
+        printf("Number of Deleted Entry: %d\n", atomic_load(&deletedCount));
+    }
+    if (resumeMode) {
+        printf("Number of Resumed File Skipped: %d - %ld bytes\n", atomic_load(&resumedCount), atomic_load(&resumedBytes));
+        printf("Number of Revalidated File: %d\n", atomic_load(&revalidatedCount));
+    }
+    if (hardlinks) {
+        printf("Number of Hard Link: %d\n", atomic_load(&linkCount));
+    }
+    if (dedupMode) {
+        printf("Number of Deduplicated File: %d - %ld bytes not written\n", atomic_load(&dedupCount), atomic_load(&dedupBytes));
+    }
+    printf("Number of Sparse File: %d\n", atomic_load(&sparseCount));
+    if (atomic_load(&failedCount) > 0) {
+        printf("Number of Failed File: %d\n", atomic_load(&failedCount));
+    }
+    long methodFiles[COPY_METHODS] = {0}, methodBytes[COPY_METHODS] = {0};
+    for (int i = 0; i < numberOfWorkers; i++) {
+        totalBytes += telemetry[i].bytes;
+        for (int m = 0; m < COPY_METHODS; m++) {
+            methodFiles[m] += telemetry[i].methodFiles[m];
+            methodBytes[m] += telemetry[i].methodBytes[m];
+        }
+    }
+    printf("LOGICAL BYTES: %ld - PHYSICAL BYTES WRITTEN: %ld\n", atomic_load(&logicalBytes), totalBytes);
     printf("TOTAL BYTES COPIED: %ld\n", totalBytes);
+    for (int i = 0; i < COPY_METHODS; i++) {
+        if (methodFiles[i] > 0) {
+            printf("Copied with %s: %ld files - %ld bytes\n", copyMethodNames[i], methodFiles[i], methodBytes[i]);
+        }
+    }
+    for (int i = 0; i < numberOfWorkers; i++) {
+        long busy = telemetry[i].busyNs, idle = telemetry[i].idleNs;
+        printf("Worker %d: %ld files - %ld bytes - busy %.0f%%\n", i, (long)telemetry[i].files, (long)telemetry[i].bytes,
+               busy + idle > 0 ? 100.0 * busy / (busy + idle) : 0.0);
+    }
+    if (queueSamples > 0) {
+        printf("Queue depth: average %.1f - max %ld\n", (double)queueSum / queueSamples, queueMax);
+    }
     printf("TOTAL TIME: %02ld:%02ld.%03ld (min:sec.mili)\n", minutes, seconds, miliseconds);
 
     // Clean up
     clean();
+    freeTable(&inodeTable);
+    freeTable(&contentTable);
+    freeTelemetry();
+    if (journalFd != -1) {
+        // A finished copy needs no resume, an interrupted or failed one keeps its journal
+        if (sigInt == 0 && atomic_load(&failedCount) == 0 && unlinkat(journalDirFd, JOURNAL_NAME, 0) == -1) {
+            perror("Error removing journal");
+        }
+        close(journalFd);
+        close(journalDirFd);
+        freeTable(&journalTable);
+    }
+    if (jsonOut != NULL && jsonOut != stdout) {
+        fclose(jsonOut);
+    }
+    if (useRing) {
+        Files item;
+        while (ringDrain(&itemRing, &item)) {
+            dropItem(&item);
+        }
+        ringDestroy(&itemRing);
+    }
     free(maxBuffer);
     pthread_cond_destroy(&condc);
     pthread_cond_destroy(&condp);
     pthread_mutex_destroy(&flag);
     pthread_mutex_destroy(&the_mutex);
-    pthread_barrier_destroy(&workerBarrier);
-    return 0;
+    return atomic_load(&failedCount) > 0;
 }
 
 void* manager(void* arg) {
     char **argv = (char **)arg;
-    createDirectory(argv[3], argv[4]); // Create directory structure
+    pthread_t walkerThreads[walkerCount];
+
+    rootDir = malloc(sizeof(dirHandle));
+    if (rootDir == NULL) {
+        perror("Error allocating directory");
+        exit(1);
+    }
+    rootDir->srcFd = open(argv[3], O_RDONLY | O_DIRECTORY); // Open source directory
+    if (rootDir->srcFd == -1) {
+        perror("Error opening source directory");
+        exit(1);
+    }
+    rootDir->destFd = open(argv[4], O_RDONLY | O_DIRECTORY);
+    if (rootDir->destFd == -1) {
+        perror("Error opening destination directory");
+        exit(1);
+    }
+    openDirs = 1;
+    rootDir->srcPath = strdup(argv[3]);
+    rootDir->destPath = strdup(argv[4]);
+    rootPathLength = strlen(argv[4]);
+    atomic_init(&rootDir->refs, 1);
+    atomic_store(&pendingDirs, 1); // The root, walker 0 starts with it
+
+    deques = malloc(sizeof(taskDeque) * walkerCount);
+    if (deques == NULL) {
+        perror("Error allocating deques");
+        exit(1);
+    }
+    for (int i = 0; i < walkerCount; i++) {
+        initDeque(&deques[i]);
+    }
+    for (int i = 0; i < walkerCount; i++) {
+        if (pthread_create(&walkerThreads[i], NULL, walker, (void *)(intptr_t)i) != 0) {
+            printf("Error creating walker thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < walkerCount; i++) {
+        if (pthread_join(walkerThreads[i], NULL) != 0) {
+            printf("Error joining walker thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < walkerCount; i++) {
+        // Tasks are only left behind after SIGINT
+        dirTask *task;
+        while ((task = popTask(&deques[i])) != NULL) {
+            releaseDir(task->parent);
+            free(task);
+        }
+        destroyDeque(&deques[i]);
+    }
+    free(deques);
+
     // Set done flag when all files are processed
     pthread_mutex_lock(&the_mutex);
     buffer.doneFlag = 1;
-    pthread_cond_broadcast(&condc);
+    wakeWorkers();
     pthread_mutex_unlock(&the_mutex);
     pthread_exit(0);
 }
 
-void createDirectory(const char* srcDirPath, const char* destDirPath) {
+void* reporter(void* arg) {
+    long lastReport = startNs;
+    long lastCommit = startNs;
+    while (1) {
+        int stop = atomic_load(&reportDone);
+        if (!stop) {
+            logWait(100, &reportDone);
+        }
+        logFlush(stdout);
+        long now = nowNs();
+        if (stop || now - lastReport >= reportInterval * 1000000L) {
+            report(now, stop);
+            lastReport = now;
+        }
+        if (journalFd != -1 && (stop || now - lastCommit >= journalInterval * 1000000L)) {
+            journalCommit(journalDirFd);
+            lastCommit = now;
+        }
+        if (stop) {
+            break;
+        }
+    }
+    pthread_exit(0);
+}
+
+void report(long now, int final) {
+    static long lastNs = 0, lastBytes = 0, lastFiles = 0;
+    long bytes = 0, files = 0, busy = 0, idle = 0;
+    for (int i = 0; i < numberOfWorkers; i++) {
+        bytes += atomic_load_explicit(&telemetry[i].bytes, memory_order_relaxed);
+        files += atomic_load_explicit(&telemetry[i].files, memory_order_relaxed);
+        busy += atomic_load_explicit(&telemetry[i].busyNs, memory_order_relaxed);
+        idle += atomic_load_explicit(&telemetry[i].idleNs, memory_order_relaxed);
+    }
+    long queued = queuedItems();
+    queueSamples++;
+    queueSum += queued;
+    if (queued > queueMax) {
+        queueMax = queued;
+    }
+    if (lastNs == 0) {
+        lastNs = startNs;
+    }
+    double seconds = (now - startNs) / 1e9;
+    double interval = now > lastNs ? (now - lastNs) / 1e9 : 1e-9;
+    double mbPerSec = (bytes - lastBytes) / interval / 1e6;
+    double filesPerSec = (files - lastFiles) / interval;
+    lastNs = now;
+    lastBytes = bytes;
+    lastFiles = files;
+
+    // Remaining work at the average rate, in bytes if the walkers know every size and in files otherwise.
+    // While the walkers run it only counts what they found so far
+    int scanning = buffer.doneFlag == 0;
+    long found = atomic_load(&foundFiles);
+    double eta = -1;
+    if (atomic_load(&unsizedFiles) == 0 && bytes > 0) {
+        eta = (atomic_load(&foundBytes) - bytes) / (bytes / seconds);
+    } else if (files > 0) {
+        eta = (found - files) / (files / seconds);
+    }
+    if (eta < 0 && files > 0) {
+        eta = 0; // Holes and unchanged blocks write less than the sizes
+    }
+
+    if (showProgress) {
+        char etaText[32] = "?";
+        if (eta >= 0) {
+            snprintf(etaText, sizeof(etaText), "%s%02ld:%02ld", scanning ? ">" : "", (long)eta / 60, (long)eta % 60);
+        }
+        fprintf(stderr, "\r%7.1fs %ld/%ld%s files %.1f MB %8.1f MB/s %8.0f files/s queue %ld ETA %s   ", seconds, files, found,
+                scanning ? "+" : "", bytes / 1e6, mbPerSec, filesPerSec, queued, etaText);
+        if (final) {
+            fprintf(stderr, "\n");
+        }
+        fflush(stderr);
+    }
+    if (jsonOut != NULL) {
+        fprintf(jsonOut, "{\"time\":%.3f,\"files\":%ld,\"bytes\":%ld,\"found_files\":%ld,\"found_bytes\":%ld,\"scanning\":%s,"
+                "\"mb_per_sec\":%.2f,\"files_per_sec\":%.1f,\"avg_mb_per_sec\":%.2f,\"avg_files_per_sec\":%.1f,"
+                "\"queue\":%ld,\"busy\":%.3f,\"eta_sec\":", seconds, files, bytes, found, (long)atomic_load(&foundBytes),
+                scanning ? "true" : "false", mbPerSec, filesPerSec, seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+                seconds > 0 ? files / seconds : 0.0, queued, busy + idle > 0 ? (double)busy / (busy + idle) : 0.0);
+        if (eta >= 0) {
+            fprintf(jsonOut, "%.1f", eta);
+        } else {
+            fprintf(jsonOut, "null");
+        }
+        fprintf(jsonOut, ",\"final\":%s}\n", final ? "true" : "false");
+        fflush(jsonOut);
+    }
+}
+
+/* A directory is done, wake the idle walkers if it was the last one */
+void finishDirectory() {
+    if (atomic_fetch_sub(&pendingDirs, 1) == 1) {
+        pthread_mutex_lock(&walkMutex);
+        pthread_cond_broadcast(&walkCond);
+        pthread_mutex_unlock(&walkMutex);
+    }
+}
+
+/* Open a queued subdirectory on both sides, relative to its parent */
+dirHandle* openDirectory(dirTask *task) {
+    dirHandle *parent = task->parent;
+    // Files in the buffer keep their directories open, wait for the workers to copy some before opening more
+    pthread_mutex_lock(&dirMutex);
+    while (openDirs >= dirLimit && queuedItems() > 0 && sigInt == 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000; // The buffer may drain without closing a handle, look again every 100 ms
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&dirCond, &dirMutex, &deadline);
+    }
+    openDirs++;
+    pthread_mutex_unlock(&dirMutex);
+
+    dirHandle *dir = malloc(sizeof(dirHandle));
+    if (dir == NULL) {
+        perror("Error allocating directory");
+        exit(1);
+    }
+    dir->srcFd = openat(parent->srcFd, task->name, O_RDONLY | O_DIRECTORY);
+    if (dir->srcFd == -1) {
+        perror("Error opening source directory");
+        dir->destFd = -1;
+    } else {
+        dir->destFd = openat(parent->destFd, task->name, O_RDONLY | O_DIRECTORY);
+        if (dir->destFd == -1) {
+            perror("Error opening destination directory");
+        }
+    }
+    if (dir->srcFd == -1 || dir->destFd == -1) {
+        close(dir->srcFd);
+        free(dir);
+        pthread_mutex_lock(&dirMutex);
+        openDirs--;
+        pthread_mutex_unlock(&dirMutex);
+        return NULL;
+    }
+    dir->srcPath = malloc(strlen(parent->srcPath) + strlen(task->name) + 2);
+    dir->destPath = malloc(strlen(parent->destPath) + strlen(task->name) + 2);
+    sprintf(dir->srcPath, "%s/%s", parent->srcPath, task->name);
+    sprintf(dir->destPath, "%s/%s", parent->destPath, task->name);
+    atomic_init(&dir->refs, 1);
+    return dir;
+}
+
+void* walker(void* arg) {
+    int self = (intptr_t)arg;
+    if (self == 0) {
+        createDirectory(rootDir, self);
+        releaseDir(rootDir);
+        finishDirectory();
+    }
+    while (sigInt == 0) {
+        dirTask *task = popTask(&deques[self]);
+        for (int i = 1; task == NULL && i < walkerCount; i++) {
+            task = stealTask(&deques[(self + i) % walkerCount]);
+        }
+        if (task != NULL) {
+            atomic_fetch_sub(&queuedDirs, 1);
+            dirHandle *dir = openDirectory(task);
+            if (dir != NULL) {
+                createDirectory(dir, self);
+                releaseDir(dir);
+            }
+            releaseDir(task->parent);
+            free(task);
+            finishDirectory();
+            continue;
+        }
+        // Nothing to steal, wait until a directory is queued or every directory is done
+        pthread_mutex_lock(&walkMutex);
+        atomic_fetch_add(&idleWalkers, 1);
+        while (atomic_load(&queuedDirs) == 0 && atomic_load(&pendingDirs) > 0 && sigInt == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000; // SIGINT cannot signal the condition, so check it every 100 ms
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&walkCond, &walkMutex, &deadline);
+        }
+        atomic_fetch_sub(&idleWalkers, 1);
+        int done = atomic_load(&pendingDirs) == 0;
+        pthread_mutex_unlock(&walkMutex);
+        if (done) {
+            break;
+        }
+    }
+    pthread_exit(0);
+}
+
+void createDirectory(dirHandle *dir, int self) {
     DIR* srcDir;
     struct dirent *entry;
     struct stat statBuf;
-    char srcPath[PATH_SIZE];
-    char destPath[PATH_SIZE];
+    char **names = NULL; // Source names, for --delete
+    int nameCount = 0, nameCapacity = 0;
+    filePack *pack = NULL; // Small files not queued yet
+    long packBytes = 0; // Buffer the pack needs, one more byte per file to notice files that grew
+    int packable = packFiles > 0 && !blockSync && !dedupMode; // --blocks and --dedup compare every file
 
-    srcDir = opendir(srcDirPath); // Open source directory
+    srcDir = fdopendir(dup(dir->srcFd)); // Own descriptor for reading, dir->srcFd stays open for openat
     if(srcDir == NULL) {
         perror("Error opening source directory");
-        exit(1);
+        return;
     }
 
     // Iterate over directory entries
@@ -193,141 +779,929 @@ void createDirectory(const char* srcDirPath, const char* destDirPath) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) { // Skip . and ..
             continue;
         }
-
-        snprintf(srcPath, sizeof(srcPath), "%s/%s", srcDirPath, entry->d_name);
-        snprintf(destPath, sizeof(destPath), "%s/%s", destDirPath, entry->d_name);
-
-        if (stat(srcPath, &statBuf) == -1) {
-            perror("Error getting file status");
-            continue;
-        }
-
         if(sigInt == 1) {
             break;
         }
-        if (S_ISDIR(statBuf.st_mode)) { // Directory
+        if (deleteMode) {
+            if (nameCount == nameCapacity) {
+                nameCapacity = nameCapacity == 0 ? 64 : nameCapacity * 2;
+                names = realloc(names, sizeof(char *) * nameCapacity);
+                if (names == NULL) {
+                    perror("Error allocating names");
+                    exit(1);
+                }
+            }
+            names[nameCount++] = strdup(entry->d_name);
+        }
+
+        // d_type saves the stat call, links and filesystems without d_type still need it
+        int type = entry->d_type;
+        int haveStat = 0;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            haveStat = 1;
+            if (fstatat(dir->srcFd, entry->d_name, &statBuf, 0) == -1) {
+                perror("Error getting file status");
+                continue;
+            }
+            type = S_ISDIR(statBuf.st_mode) ? DT_DIR : S_ISREG(statBuf.st_mode) ? DT_REG : S_ISFIFO(statBuf.st_mode) ? DT_FIFO : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) { // Directory
             // Create directory
-            if (mkdir(destPath, 0755) == -1 && errno != EEXIST) {
+            if (mkdirat(dir->destFd, entry->d_name, 0755) == -1 && errno != EEXIST) {
                 perror("Error creating directory");
                 continue;
             }
-            dirCount++; // Increment directory count
-            // Recursively create subdirectories and files
-            createDirectory(srcPath, destPath);
-        } else if (S_ISREG(statBuf.st_mode)) { // Regular file
-            int srcFd;
-            int destFd;
-
-            // Open source file
-            srcFd = open(srcPath, O_RDONLY, 0444);
-            if (srcFd == -1) {
-                perror("Error while opening source file");
-                continue;
+            atomic_fetch_add(&dirCount, 1); // Increment directory count
+            // Queue it for this walker, idle walkers steal it
+            dirTask *task = malloc(sizeof(dirTask));
+            if (task == NULL) {
+                perror("Error allocating directory task");
+                exit(1);
+            }
+            task->parent = dir;
+            atomic_fetch_add(&dir->refs, 1);
+            strcpy(task->name, entry->d_name);
+            atomic_fetch_add(&pendingDirs, 1);
+            pushTask(&deques[self], task);
+            atomic_fetch_add(&queuedDirs, 1);
+            if (atomic_load(&idleWalkers) > 0) {
+                pthread_mutex_lock(&walkMutex);
+                pthread_cond_signal(&walkCond);
+                pthread_mutex_unlock(&walkMutex);
             }
-            // Create an empty file
-            destFd = open(destPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (destFd == -1) {
-                close(srcFd);
-                perror("Error while creating destination file");
-            }
-            fileCount++; // Increment file count
-            
-            Files item; // Create a new item
-            item.srcFd = srcFd; // Set source file descriptor
-            item.destFd = destFd; // Set destination file descriptor
-            strcpy(item.srcName, srcPath); // Set source file name
-            strcpy(item.destName, destPath); // Set destination file name
+        } else if (type == DT_REG) { // Regular file
             if(sigInt == 1) {
-                close(srcFd);
-                close(destFd);
                 break;
             }
+            atomic_fetch_add(&fileCount, 1); // Increment file count
+            if ((syncMode || hardlinks || packable || resumeMode) && !haveStat) {
+                haveStat = fstatat(dir->srcFd, entry->d_name, &statBuf, 0) == 0;
+            }
+            int firstLink = 0; // Destination of the first link of this run, other names are linked to it on purpose
+            if (hardlinks && haveStat && statBuf.st_nlink > 1) {
+                char destPath[PATH_SIZE];
+                snprintf(destPath, sizeof(destPath), "%s/%s", dir->destPath, entry->d_name);
+                const char *target = findOrAdd(&inodeTable, statBuf.st_dev, statBuf.st_ino, NULL);
+                if (target == NULL) {
+                    // First link, create it before the table shows it, so the other links can point to it before it is copied
+                    if (!(syncMode && unchanged(dir, entry->d_name, &statBuf))) {
+                        breakLink(dir, entry->d_name);
+                        int fd = openat(dir->destFd, entry->d_name, O_WRONLY | O_CREAT, 0644);
+                        if (fd != -1) {
+                            close(fd);
+                        }
+                    }
+                    target = findOrAdd(&inodeTable, statBuf.st_dev, statBuf.st_ino, destPath); // Another walker may have been first
+                    firstLink = target == NULL;
+                }
+                if (target != NULL && linkDestination(target, dir, entry->d_name)) {
+                    atomic_fetch_add(&linkCount, 1);
+                    continue;
+                }
+            }
+            if (syncMode && haveStat && unchanged(dir, entry->d_name, &statBuf)) {
+                atomic_fetch_add(&skippedCount, 1);
+                atomic_fetch_add(&skippedBytes, statBuf.st_size);
+                continue;
+            }
+            if (!firstLink) {
+                breakLink(dir, entry->d_name); // Written in place below, a name linked by an earlier run would change too
+            }
+            int revalidate = 0;
+            struct stat destStat;
+            if (resumeMode && haveStat && fstatat(dir->destFd, entry->d_name, &destStat, 0) == 0 && S_ISREG(destStat.st_mode)) {
+                char path[PATH_SIZE];
+                journalPath(dir, entry->d_name, path, sizeof(path));
+                if (destStat.st_size == statBuf.st_size
+                    && journaled(&journalTable, path, statBuf.st_size, statBuf.st_mtim.tv_sec, statBuf.st_mtim.tv_nsec, -1)) {
+                    atomic_fetch_add(&resumedCount, 1);
+                    atomic_fetch_add(&resumedBytes, statBuf.st_size);
+                    continue;
+                }
+                revalidate = 1; // The interrupted run may have written part of it
+            }
+            atomic_fetch_add(&foundFiles, 1);
+            if (haveStat) {
+                atomic_fetch_add(&foundBytes, statBuf.st_size);
+            } else {
+                atomic_fetch_add(&unsizedFiles, 1);
+            }
+
+            if (packable && !revalidate && haveStat && statBuf.st_size <= PACK_SMALL && !sparse(&statBuf)) {
+                // Small files wait for more of this directory, so a worker takes many of them at once.
+                // A file to revalidate is compared block by block alone, a pack truncates its destinations
+                if (pack == NULL) {
+                    pack = malloc(sizeof(filePack));
+                    if (pack == NULL) {
+                        perror("Error allocating pack");
+                        exit(1);
+                    }
+                    pack->count = 0;
+                    packBytes = 0;
+                }
+                pack->names[pack->count] = strdup(entry->d_name);
+                if (pack->names[pack->count] == NULL) {
+                    perror("Error allocating file name");
+                    exit(1);
+                }
+                pack->sizes[pack->count++] = statBuf.st_size;
+                packBytes += statBuf.st_size + 1;
+                atomic_fetch_add(&dir->refs, 1);
+                if (pack->count == packFiles || packBytes + PACK_SMALL + 1 > COPY_BUFFER_SIZE) {
+                    queuePack(dir, pack);
+                    pack = NULL;
+                }
+                continue;
+            }
+
+            Files item = {0}; // Create a new item, the worker opens and creates the file
+            item.revalidate = revalidate;
+            if (revalidate) {
+                atomic_fetch_add(&revalidatedCount, 1);
+            }
+            item.dir = dir; // The directory stays open until the file is copied
+            atomic_fetch_add(&dir->refs, 1);
+            item.name = strdup(entry->d_name);
+            if (item.name == NULL) {
+                perror("Error allocating file name");
+                exit(1);
+            }
             add_item(item); // Add item to buffer
-        } else if (S_ISFIFO(statBuf.st_mode)) { // FIFO file
+        } else if (type == DT_FIFO) { // FIFO file
             // Create FIFO
-            if (mkfifo(destPath, 0644) == -1) {
+            if (mkfifoat(dir->destFd, entry->d_name, 0644) == -1) {
                 perror("Error creating FIFO");
                 continue;
             }
-            fifoCount++;
+            atomic_fetch_add(&fifoCount, 1);
         }
     }
     closedir(srcDir);
+    if (pack != NULL) {
+        queuePack(dir, pack);
+    }
+    if (deleteMode) {
+        if (sigInt == 0) { // An interrupted listing is incomplete, nothing may be deleted
+            deleteExtra(dir, names, nameCount);
+        }
+        for (int i = 0; i < nameCount; i++) {
+            free(names[i]);
+        }
+        free(names);
+    }
+}
+
+/* Order of names for qsort and bsearch */
+int compareNames(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+int unchanged(dirHandle *dir, const char *name, struct stat *srcStat) {
+    struct stat destStat;
+    if (fstatat(dir->destFd, name, &destStat, 0) == -1) {
+        return 0; // Not copied yet
+    }
+    return S_ISREG(destStat.st_mode) && destStat.st_size == srcStat->st_size
+        && destStat.st_mtim.tv_sec == srcStat->st_mtim.tv_sec && destStat.st_mtim.tv_nsec == srcStat->st_mtim.tv_nsec;
+}
+
+void deleteExtra(dirHandle *dir, char **names, int count) {
+    qsort(names, count, sizeof(char *), compareNames);
+    DIR *destDir = fdopendir(dup(dir->destFd));
+    if (destDir == NULL) {
+        perror("Error opening destination directory");
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(destDir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char *name = entry->d_name;
+        if (journalFd != -1 && strlen(dir->destPath) == rootPathLength && strcmp(name, JOURNAL_NAME) == 0) {
+            continue;
+        }
+        if (bsearch(&name, names, count, sizeof(char *), compareNames) == NULL) {
+            removeEntry(dir->destFd, name);
+            if (!quiet) {
+                logLine("Deleted %s/%s\n", dir->destPath, name); // Printed by the reporter like the copied files
+            }
+            atomic_fetch_add(&deletedCount, 1);
+        }
+    }
+    closedir(destDir);
+}
+
+void removeEntry(int dirFd, const char *name) {
+    if (unlinkat(dirFd, name, 0) == 0 || (errno != EISDIR && errno != EPERM)) {
+        return; // Linux returns EISDIR for directories, POSIX EPERM
+    }
+    int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *subDir = fd == -1 ? NULL : fdopendir(fd);
+    if (subDir == NULL) {
+        perror("Error opening directory to delete");
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(subDir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            removeEntry(fd, entry->d_name);
+        }
+    }
+    closedir(subDir);
+    if (unlinkat(dirFd, name, AT_REMOVEDIR) == -1) {
+        perror("Error deleting directory");
+    }
+}
+
+void breakLink(dirHandle *dir, const char *name) {
+    struct stat destStat;
+    if (fstatat(dir->destFd, name, &destStat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(destStat.st_mode) && destStat.st_nlink > 1
+        && unlinkat(dir->destFd, name, 0) == -1) {
+        perror("Error unlinking destination file");
+    }
+}
+
+int linkDestination(const char *target, dirHandle *dir, const char *name) {
+    struct stat targetStat, destStat;
+    if (stat(target, &targetStat) == 0 && fstatat(dir->destFd, name, &destStat, 0) == 0
+        && targetStat.st_dev == destStat.st_dev && targetStat.st_ino == destStat.st_ino) {
+        return 1; // Linked by an earlier run
+    }
+    unlinkat(dir->destFd, name, 0); // A copy of an earlier run without --hardlinks
+    if (linkat(AT_FDCWD, target, dir->destFd, name, 0) == -1) {
+        perror("Error creating hard link");
+        return 0;
+    }
+    return 1;
+}
+
+int dedupFile(Files *item, long size, char *buffer, uint64_t *hash) {
+    *hash = hashFile(item->srcFd, size, buffer);
+    const char *match = findOrAdd(&contentTable, size, *hash, NULL);
+    if (match == NULL) {
+        return 0;
+    }
+    int matchFd = open(match, O_RDONLY);
+    if (matchFd == -1) {
+        return 0;
+    }
+    // Equal hashes are only a hint, the bytes decide
+    int done = 0;
+    if (sameContent(item->srcFd, matchFd, size, buffer)) {
+        if (dedupMode == 1) {
+            done = reflink(matchFd, item->destFd);
+        } else {
+            close(item->destFd);
+            unlinkat(item->dir->destFd, item->name, 0);
+            done = linkat(AT_FDCWD, match, item->dir->destFd, item->name, 0) == 0;
+            if (!done) {
+                perror("Error creating hard link");
+            }
+            // The file is open again for a copy, or for keepTimes on the link
+            item->destFd = openat(item->dir->destFd, item->name, O_WRONLY | O_CREAT, 0644);
+        }
+    }
+    close(matchFd);
+    return done;
+}
+
+void keepTimes(int srcFd, int destFd) {
+    struct stat statBuf;
+    if (fstat(srcFd, &statBuf) == 0) {
+        struct timespec times[2] = {statBuf.st_atim, statBuf.st_mtim};
+        if (futimens(destFd, times) == -1) {
+            perror("Error setting destination file times");
+        }
+    }
 }
 
 void* worker(void* arg) {
+    myStats = &telemetry[(intptr_t)arg];
+    long mark = nowNs(); // Start of the current busy or idle time
+    char *copyBuffer = malloc(blockSync || dedupMode || resumeMode ? 2 * COPY_BUFFER_SIZE : COPY_BUFFER_SIZE); // Only used when the kernel cannot copy the file, by --blocks, --dedup and --resume
+    if (copyBuffer == NULL) {
+        perror("Error allocating copy buffer");
+        exit(1);
+    }
     while (1) {
         if(sigInt == 1) {
             break;
         }
+        account(&mark, 0);
         Files item = remove_item();
-        if (item.srcFd == -1 || item.destFd == -1) {
-            pthread_mutex_lock(&the_mutex); // lock
-            if(activeWorker == numberOfWorkers) { // If threads already leaves while no need to wait here
-                pthread_mutex_unlock(&the_mutex); // unlock
-                pthread_barrier_wait(&workerBarrier); // If file is not open correctly, worker waits here
-            } else {
-                pthread_mutex_unlock(&the_mutex); // unlock
-            }
-            if (item.srcFd == -1 && item.destFd == -1) {
-                pthread_mutex_lock(&the_mutex);
-                if(activeWorker == numberOfWorkers) { // If any thread already set wait, no need to set again
-                    wait = 1; // Used for make sure everyone will wait other threads in the end
-                }
-                pthread_mutex_unlock(&the_mutex);
-                break;
-            }
+        account(&mark, 1);
+        if (item.dir == NULL && item.job == NULL) {
+            break; // Every file is copied, main joins the workers
+        }
+        if (item.pack != NULL) {
+            notSplit(); // Packed files are small, they are never split
+            copyPack(&item, copyBuffer);
+            continue;
+        }
+        if (item.job == NULL && !openItem(&item)) {
+            notSplit();
             continue;
         }
         if(sigInt == 1) {
-            close(item.srcFd);
-            close(item.destFd);
+            if (item.job == NULL) {
+                close(item.srcFd);
+                close(item.destFd);
+                releaseDir(item.dir);
+                free(item.name);
+            }
             break;
         }
 
-        // Copy file content from srcFd to destFd
-        char buffer[1024];
-        ssize_t bytes_read;
-        ssize_t bytes_write;
-        long totalWritten = 0;
-        while ((bytes_read = read(item.srcFd, buffer, sizeof(buffer))) > 0) {
-            bytes_write = write(item.destFd, buffer, bytes_read);
-            if(sigInt == 1) {
+        if (item.job == NULL) {
+            // Large files are split once here, unless a reflink copies them at once
+            struct stat statBuf;
+            int reflinked = 0;
+            if (fstat(item.srcFd, &statBuf) == -1) {
+                perror("Error getting file status");
                 close(item.srcFd);
                 close(item.destFd);
+                notSplit();
+                releaseDir(item.dir);
+                free(item.name);
+                continue;
+            }
+            int large = chunkThreshold > 0 && statBuf.st_size > chunkThreshold && numberOfWorkers > 1;
+            if (large && !(reflinked = reflink(item.srcFd, item.destFd))) {
+                item.job = splitFile(&item, &statBuf);
+                item.offset = 0;
+                item.length = chunkSize;
+            } else {
+                notSplit(); // Workers waiting for chunks of this file can leave
+                copyWhole(&item, &statBuf, reflinked, copyBuffer);
+            }
+        }
+        if (item.job != NULL) {
+            fileJob *job = item.job;
+            int method = job->method;
+            long totalWritten;
+            char path[PATH_SIZE];
+            if (journalFd != -1) {
+                journalPath(job->dir, job->name, path, sizeof(path));
+            }
+            int resumed = resumeMode && journaled(&journalTable, path, job->size, job->mtimeSec, job->mtimeNsec, item.offset);
+            if (resumed) {
+                totalWritten = 0; // Copied and synced by the interrupted run
+            } else if (blockSync || job->revalidate) {
+                method = COPY_BLOCKS;
+                totalWritten = syncRange(job->srcFd, job->destFd, item.offset, item.length, copyBuffer, &sigInt);
+            } else {
+                totalWritten = copyExtents(job->srcFd, job->destFd, item.offset, item.length, copyBuffer, &method, &sigInt);
+            }
+            if (journalFd != -1 && !resumed && totalWritten >= 0 && sigInt == 0) {
+                journalAdd(path, job->size, job->mtimeSec, job->mtimeNsec, item.offset);
+            }
+            atomic_fetch_add(&job->bytes, totalWritten > 0 ? totalWritten : 0);
+            countBytes(totalWritten); // The rate and the worker line follow the chunks, not only the last one
+            job->method = method;
+            if (atomic_fetch_sub(&job->remaining, 1) == 1) { // Last chunk, the file is complete
+                if (syncMode) {
+                    keepTimes(job->srcFd, job->destFd);
+                }
+                struct stat statBuf;
+                atomic_fetch_add(&logicalBytes, job->size);
+                if (fstat(job->srcFd, &statBuf) == 0 && sparse(&statBuf)) {
+                    atomic_fetch_add(&sparseCount, 1);
+                }
+                close(job->srcFd);
+                close(job->destFd);
+                statBuf.st_size = job->size; // The journal gets the status from when the file was split, like its chunks
+                statBuf.st_mtim.tv_sec = job->mtimeSec;
+                statBuf.st_mtim.tv_nsec = job->mtimeNsec;
+                fileCopied(job->dir, job->name, atomic_load(&job->bytes), job->method, &statBuf, 1);
+                free(job);
+            }
+        }
+    }
+    account(&mark, 0);
+    free(copyBuffer);
+    while (batchNext < batchCount) { // Left after SIGINT
+        dropItem(&ringBatch[batchNext]);
+        batchNext++;
+    }
+    pthread_exit(0);
+}
+
+void copyWhole(Files *item, struct stat *statBuf, int reflinked, char *copyBuffer) {
+    int method;
+    long totalWritten;
+    uint64_t hash = 0;
+    int deduped = 0;
+    if (dedupMode && statBuf->st_size > 0 && !reflinked) {
+        deduped = dedupFile(item, statBuf->st_size, copyBuffer, &hash);
+    }
+    if (deduped) {
+        method = COPY_DEDUP;
+        totalWritten = 0;
+        atomic_fetch_add(&dedupCount, 1);
+        atomic_fetch_add(&dedupBytes, statBuf->st_size);
+    } else if (reflinked) {
+        method = COPY_REFLINK;
+        totalWritten = statBuf->st_size;
+    } else if ((blockSync || item->revalidate) && reflink(item->srcFd, item->destFd)) {
+        method = COPY_REFLINK;
+        totalWritten = statBuf->st_size;
+    } else if (blockSync || item->revalidate) {
+        // The destination was not truncated, compare it and cut it to the source size
+        method = COPY_BLOCKS;
+        totalWritten = syncRange(item->srcFd, item->destFd, 0, statBuf->st_size, copyBuffer, &sigInt);
+        if (ftruncate(item->destFd, statBuf->st_size) == -1) {
+            perror("Error setting destination file size");
+        }
+    } else {
+        // Copy file content from srcFd to destFd
+        totalWritten = copyFile(item->srcFd, item->destFd, copyBuffer, &method, &sigInt);
+    }
+    if (syncMode) {
+        keepTimes(item->srcFd, item->destFd);
+    }
+    atomic_fetch_add(&logicalBytes, statBuf->st_size);
+    if (sparse(statBuf)) {
+        atomic_fetch_add(&sparseCount, 1);
+    }
+    if (dedupMode && statBuf->st_size > 0 && !deduped && totalWritten == statBuf->st_size) {
+        // Later files with this content share this copy
+        char destPath[PATH_SIZE];
+        snprintf(destPath, sizeof(destPath), "%s/%s", item->dir->destPath, item->name);
+        findOrAdd(&contentTable, statBuf->st_size, hash, destPath);
+    }
+    // Close file descriptors
+    close(item->srcFd);
+    close(item->destFd);
+    fileCopied(item->dir, item->name, totalWritten, method, statBuf, 0);
+}
+
+void copyPack(Files *item, char *copyBuffer) {
+    filePack *pack = item->pack;
+    dirHandle *dir = item->dir;
+    int srcFds[PACK_FILES];
+    struct stat srcStats[PACK_FILES]; // Status at open for the journal, the walker did not keep the times
+    long lengths[PACK_FILES]; // Bytes read, -1 if the read failed or the file grew
+    long offsets[PACK_FILES];
+
+    // Open every source first and ask for all of them, the kernel reads ahead while the first ones are read
+    for (int i = 0; i < pack->count; i++) {
+        srcFds[i] = openat(dir->srcFd, pack->names[i], O_RDONLY);
+        if (srcFds[i] == -1) {
+            perror("Error while opening source file");
+            continue;
+        }
+        if (journalFd != -1 && fstat(srcFds[i], &srcStats[i]) == -1) {
+            perror("Error getting file status");
+            srcStats[i].st_size = -1; // Matches no source on resume
+            srcStats[i].st_mtim.tv_sec = 0;
+            srcStats[i].st_mtim.tv_nsec = 0;
+        }
+        if (pack->sizes[i] > 0) {
+            posix_fadvise(srcFds[i], 0, 0, POSIX_FADV_WILLNEED);
+        }
+    }
+    // One burst of reads into the buffer
+    long used = 0;
+    for (int i = 0; i < pack->count; i++) {
+        lengths[i] = -1;
+        if (srcFds[i] == -1 || sigInt == 1) {
+            continue;
+        }
+        offsets[i] = used;
+        // Until the end of the file, or one byte past the size the walker saw, a read may return less
+        long got = 0;
+        ssize_t n = 0;
+        while (got <= pack->sizes[i] && ((n = read(srcFds[i], copyBuffer + used + got, pack->sizes[i] + 1 - got)) > 0
+                                          || (n == -1 && errno == EINTR))) {
+            got += n > 0 ? n : 0;
+        }
+        if (n == -1) {
+            perror("Error reading source file");
+        } else if (got <= pack->sizes[i]) { // A file that grew since the walker saw it is copied alone below
+            lengths[i] = got;
+            used += got;
+        }
+    }
+    // Then one burst of writes
+    int destFds[PACK_FILES];
+    for (int i = 0; i < pack->count; i++) {
+        destFds[i] = -1;
+        if (srcFds[i] == -1 || sigInt == 1) {
+            close(srcFds[i]);
+            releaseDir(dir);
+            free(pack->names[i]);
+            continue;
+        }
+        destFds[i] = openat(dir->destFd, pack->names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (destFds[i] == -1) {
+            perror("Error while creating destination file");
+            close(srcFds[i]);
+            releaseDir(dir);
+            free(pack->names[i]);
+            continue;
+        }
+        if (lengths[i] == -1) {
+            continue; // Copied alone once the buffer is free
+        }
+        if (write(destFds[i], copyBuffer + offsets[i], lengths[i]) != lengths[i]) {
+            perror("Error writing to destination file"); // Short or failed, not counted or journaled as copied
+            atomic_fetch_add(&failedCount, 1);
+            close(srcFds[i]);
+            close(destFds[i]);
+            releaseDir(dir);
+            free(pack->names[i]);
+            continue;
+        }
+        if (syncMode) {
+            keepTimes(srcFds[i], destFds[i]);
+        }
+        atomic_fetch_add(&logicalBytes, lengths[i]);
+        close(srcFds[i]);
+        close(destFds[i]);
+        fileCopied(dir, pack->names[i], lengths[i], COPY_PACKED, &srcStats[i], 0);
+    }
+    // Files that grew or could not be read start over with the whole file engine
+    for (int i = 0; i < pack->count; i++) {
+        if (destFds[i] == -1 || lengths[i] != -1) {
+            continue;
+        }
+        Files file = {.dir = dir, .name = pack->names[i], .srcFd = srcFds[i], .destFd = destFds[i]};
+        struct stat statBuf;
+        if (lseek(file.srcFd, 0, SEEK_SET) == -1 || fstat(file.srcFd, &statBuf) == -1) {
+            perror("Error restarting copy");
+            atomic_fetch_add(&failedCount, 1);
+            close(file.srcFd);
+            close(file.destFd);
+            releaseDir(dir);
+            free(file.name);
+            continue;
+        }
+        copyWhole(&file, &statBuf, 0, copyBuffer);
+    }
+    free(pack);
+}
+
+/* Start the opens and the statx of a file taken by a uring worker */
+void uringStart(uring *ring, uringFile *files, int index, Files *item) {
+    uringFile *f = &files[index];
+    memset(f, 0, sizeof(uringFile));
+    f->item = *item;
+    f->item.srcFd = -1;
+    f->item.destFd = -1;
+    f->active = 1;
+    f->pending = 3;
+
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = item->dir->srcFd;
+    sqe->addr = (unsigned long)item->name;
+    sqe->open_flags = O_RDONLY;
+    sqe->flags = IOSQE_IO_LINK; // The destination is only created when the source opened
+    sqe->user_data = uringData(index, URING_OPEN_SRC, 0);
+
+    sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = item->dir->destFd;
+    sqe->addr = (unsigned long)item->name;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0644;
+    sqe->user_data = uringData(index, URING_OPEN_DEST, 0);
+
+    sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = item->dir->srcFd;
+    sqe->addr = (unsigned long)item->name;
+    sqe->len = STATX_SIZE | STATX_BLOCKS | STATX_MTIME;
+    sqe->off = (unsigned long)&f->stx;
+    sqe->user_data = uringData(index, URING_STATX, 0);
+}
+
+void* uringWorker(void* arg) {
+    static atomic_int warned = 0;
+    myStats = &telemetry[(intptr_t)arg];
+    long mark = nowNs(); // Start of the current busy or idle time
+    uring ring;
+    if (!uringInit(&ring, URING_DEPTH)) {
+        if (atomic_exchange(&warned, 1) == 0) {
+            perror("io_uring is not available, using the sync engine");
+        }
+        return worker(arg);
+    }
+    char *blocks;
+    if (posix_memalign((void **)&blocks, 4096, (size_t)URING_SLOTS * URING_BLOCK) != 0) {
+        perror("Error allocating io_uring buffers");
+        exit(1);
+    }
+    struct iovec iov[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) {
+        iov[i].iov_base = blocks + (size_t)i * URING_BLOCK;
+        iov[i].iov_len = URING_BLOCK;
+    }
+    int fixed = uringRegisterBuffers(&ring, iov, URING_SLOTS); // Fixed buffers save mapping the pages on every request
+    char *copyBuffer = malloc(resumeMode ? 2 * COPY_BUFFER_SIZE : COPY_BUFFER_SIZE); // Sparse, failed and revalidated files go through the synchronous engine
+    if (copyBuffer == NULL) {
+        perror("Error allocating copy buffer");
+        exit(1);
+    }
+    uringFile files[URING_FILES];
+    memset(files, 0, sizeof(files));
+    int freeSlots[URING_SLOTS]; // Buffers without a read->write pair
+    int slotLength[URING_SLOTS];
+    int freeCount = URING_SLOTS;
+    for (int i = 0; i < URING_SLOTS; i++) {
+        freeSlots[i] = i;
+    }
+    int active = 0;
+    int done = 0;
+
+    while (sigInt == 0 && (!done || active > 0)) {
+        // Take files while there is room, wait in the queue only when nothing is in flight
+        while (!done && active < URING_FILES) {
+            Files item;
+            if (active == 0) {
+                account(&mark, 0);
+                item = remove_item();
+                account(&mark, 1);
+                if (item.dir == NULL) {
+                    done = 1;
+                    break;
+                }
+            } else if (!tryRemoveItem(&item)) {
                 break;
             }
-            if (bytes_write != bytes_read) {
-                perror("Error writing to destination file");
+            notSplit(); // Files are never split with this engine
+            if (item.pack != NULL) {
+                copyPack(&item, copyBuffer); // Small files gain nothing from the ring
+                continue;
+            }
+            if (item.revalidate) {
+                // Compared block by block with the synchronous engine
+                struct stat statBuf;
+                if (openItem(&item) && fstat(item.srcFd, &statBuf) == 0) {
+                    copyWhole(&item, &statBuf, 0, copyBuffer);
+                }
+                continue;
+            }
+            int index = 0;
+            while (files[index].active) {
+                index++;
+            }
+            uringStart(&ring, files, index, &item);
+            active++;
+        }
+        if (active == 0) {
+            continue;
+        }
+
+        if (uringSubmit(&ring, 1) == -1) {
+            break;
+        }
+        struct io_uring_cqe cqe;
+        while (uringPeek(&ring, &cqe)) {
+            int index = cqe.user_data >> 32;
+            int op = (cqe.user_data >> 16) & 0xffff;
+            int slot = cqe.user_data & 0xffff;
+            uringFile *f = &files[index];
+            switch (op) {
+            case URING_OPEN_SRC:
+            case URING_OPEN_DEST:
+                f->pending--;
+                if (cqe.res >= 0) {
+                    *(op == URING_OPEN_SRC ? &f->item.srcFd : &f->item.destFd) = cqe.res;
+                } else {
+                    if (cqe.res != -ECANCELED) {
+                        errno = -cqe.res;
+                        perror(op == URING_OPEN_SRC ? "Error while opening source file" : "Error while creating destination file");
+                    }
+                    f->failed = 1;
+                }
+                break;
+            case URING_STATX:
+                f->pending--;
+                if (cqe.res < 0) {
+                    errno = -cqe.res;
+                    perror("Error getting file status");
+                    f->failed = 1;
+                }
+                f->size = f->stx.stx_size;
+                break;
+            case URING_READ:
+                if (cqe.res != slotLength[slot]) {
+                    f->failed = 1; // Short or failed, the linked write is canceled
+                }
+                break;
+            case URING_WRITE:
+                f->blocks--;
+                freeSlots[freeCount++] = slot;
+                if (cqe.res == slotLength[slot]) {
+                    f->written += cqe.res;
+                } else {
+                    f->failed = 1;
+                }
+                break;
+            case URING_CLOSE:
+                f->pending--;
                 break;
             }
-            totalWritten += bytes_write;
         }
-        // Close file descriptors
-        close(item.srcFd);
-        close(item.destFd);
 
-        pthread_mutex_lock(&the_mutex); // lock
-        totalBytes += totalWritten; // Increment total bytes
-        // Print completion status to standard output
-        printf("Copied %s to %s\n", item.srcName, item.destName);
-        pthread_mutex_unlock(&the_mutex); // unlock
-        pthread_barrier_wait(&workerBarrier); // If worker copied a file, waits here
+        // Move every file as far as its completions allow
+        for (int index = 0; index < URING_FILES; index++) {
+            uringFile *f = &files[index];
+            if (!f->active || f->pending > 0) {
+                continue;
+            }
+            if (f->closing) {
+                struct stat statBuf; // Taken with the opens, before the copy
+                statBuf.st_size = f->stx.stx_size;
+                statBuf.st_mtim.tv_sec = f->stx.stx_mtime.tv_sec;
+                statBuf.st_mtim.tv_nsec = f->stx.stx_mtime.tv_nsec;
+                atomic_fetch_add(&logicalBytes, f->size);
+                fileCopied(f->item.dir, f->item.name, f->written, COPY_URING, &statBuf, 0);
+                f->active = 0;
+                active--;
+                continue;
+            }
+            if (!f->copying) {
+                if (f->failed && (f->item.srcFd == -1 || f->item.destFd == -1)) {
+                    close(f->item.srcFd);
+                    close(f->item.destFd);
+                    releaseDir(f->item.dir);
+                    free(f->item.name);
+                    f->active = 0;
+                    active--;
+                    continue;
+                }
+                f->copying = 1;
+                if (f->stx.stx_blocks * 512 < f->stx.stx_size) {
+                    f->failed = 1; // Sparse, reads would fill the holes with zeros
+                }
+            }
+            // Pair a read and a write for each free buffer, the write starts when the read completed
+            while (!f->failed && f->next < f->size && freeCount > 0) {
+                int slot = freeSlots[--freeCount];
+                slotLength[slot] = f->size - f->next < URING_BLOCK ? f->size - f->next : URING_BLOCK;
+                struct io_uring_sqe *sqe = uringSqe(&ring);
+                sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                sqe->fd = f->item.srcFd;
+                sqe->addr = (unsigned long)iov[slot].iov_base;
+                sqe->len = slotLength[slot];
+                sqe->off = f->next;
+                sqe->buf_index = slot;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = uringData(index, URING_READ, slot);
+                sqe = uringSqe(&ring);
+                sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                sqe->fd = f->item.destFd;
+                sqe->addr = (unsigned long)iov[slot].iov_base;
+                sqe->len = slotLength[slot];
+                sqe->off = f->next;
+                sqe->buf_index = slot;
+                sqe->user_data = uringData(index, URING_WRITE, slot);
+                f->next += slotLength[slot];
+                f->blocks++;
+            }
+            if (f->blocks > 0 || (!f->failed && f->next < f->size)) {
+                continue; // Blocks in flight or waiting for a buffer
+            }
+            if (f->failed) {
+                // Start over with the synchronous engine, it also handles the holes
+                struct stat statBuf;
+                if (ftruncate(f->item.destFd, 0) == -1 || fstat(f->item.srcFd, &statBuf) == -1) {
+                    perror("Error restarting copy");
+                }
+                copyWhole(&f->item, &statBuf, 0, copyBuffer);
+                f->active = 0;
+                active--;
+                continue;
+            }
+            if (syncMode) {
+                keepTimes(f->item.srcFd, f->item.destFd);
+            }
+            f->closing = 1;
+            f->pending = 2;
+            struct io_uring_sqe *sqe = uringSqe(&ring);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = f->item.srcFd;
+            sqe->user_data = uringData(index, URING_CLOSE, 0);
+            sqe = uringSqe(&ring);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = f->item.destFd;
+            sqe->user_data = uringData(index, URING_CLOSE, 0);
+        }
     }
-    pthread_mutex_lock(&the_mutex); // lock    
-    activeWorker--;
-    if(wait == 1 && buffer.count == 0) { // If wait is one, check if buffer count is zero, so workers will wait other workers if anybody stuck inside while barrier waits
-        pthread_mutex_unlock(&the_mutex); // unlock
-        pthread_barrier_wait(&workerBarrier);
-        wait = 0;
+    account(&mark, 0);
+    uringExit(&ring);
+    free(blocks);
+    free(copyBuffer);
+    while (batchNext < batchCount) { // Left after SIGINT
+        dropItem(&ringBatch[batchNext]);
+        batchNext++;
+    }
+    pthread_exit(0);
+}
+
+fileJob* splitFile(Files *item, struct stat *statBuf) {
+    long size = statBuf->st_size;
+    fileJob *job = malloc(sizeof(fileJob));
+    if (job == NULL) {
+        perror("Error allocating file job");
+        exit(1);
+    }
+    job->srcFd = item->srcFd;
+    job->destFd = item->destFd;
+    job->dir = item->dir; // The job takes over the directory reference and the name
+    job->name = item->name;
+    job->size = size;
+    job->chunks = (size + chunkSize - 1) / chunkSize;
+    job->nextChunk = 1; // The splitting worker copies the first chunk
+    atomic_init(&job->remaining, job->chunks);
+    atomic_init(&job->bytes, 0);
+    job->method = COPY_RANGE;
+    job->revalidate = item->revalidate;
+    job->mtimeSec = statBuf->st_mtim.tv_sec;
+    job->mtimeNsec = statBuf->st_mtim.tv_nsec;
+    // Full size first, so chunks can be written in any order
+    if (ftruncate(job->destFd, size) == -1) {
+        perror("Error setting destination file size");
+    }
+    pthread_mutex_lock(&the_mutex);
+    job->next = splitJobs;
+    splitJobs = job;
+    pendingSplits--;
+    splitCount++;
+    wakeWorkers(); // Idle workers take the other chunks
+    pthread_mutex_unlock(&the_mutex);
+    return job;
+}
+
+int openItem(Files *item) {
+    item->srcFd = openat(item->dir->srcFd, item->name, O_RDONLY);
+    if (item->srcFd == -1) {
+        perror("Error while opening source file");
     } else {
-        pthread_mutex_unlock(&the_mutex); // unlock
+        // Create an empty file
+        // --blocks reads the old content, so it must not be truncated
+        item->destFd = openat(item->dir->destFd, item->name, blockSync || item->revalidate ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (item->destFd == -1) {
+            perror("Error while creating destination file");
+            close(item->srcFd);
+        } else {
+            return 1;
+        }
     }
+    releaseDir(item->dir);
+    free(item->name);
+    return 0;
+}
 
-    pthread_exit(0);
+void journalPath(dirHandle *dir, const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", dir->destPath + rootPathLength, name);
+}
+
+void journalFile(dirHandle *dir, const char *name, struct stat *srcStat) {
+    char path[PATH_SIZE];
+    journalPath(dir, name, path, sizeof(path));
+    journalAdd(path, srcStat->st_size, srcStat->st_mtim.tv_sec, srcStat->st_mtim.tv_nsec, -1);
+}
+
+void queuePack(dirHandle *dir, filePack *pack) {
+    Files item = {0};
+    item.dir = dir; // The walker took a reference for each file
+    item.pack = pack;
+    add_item(item);
+}
+
+void notSplit() {
+    if (--pendingSplits == 0 && buffer.doneFlag == 1) {
+        pthread_mutex_lock(&the_mutex);
+        wakeWorkers();
+        pthread_mutex_unlock(&the_mutex);
+    }
+}
+
+void fileCopied(dirHandle *dir, char *name, long bytes, int method, struct stat *srcStat, int chunked) {
+    countFile(bytes, method, chunked);
+    if (journalFd != -1 && bytes >= 0 && sigInt == 0) { // A copy stopped by SIGINT is not complete
+        journalFile(dir, name, srcStat);
+    }
+    if (!quiet) {
+        // The reporter prints it, the worker only copies the line into the log buffer
+        logLine("Copied %s/%s to %s/%s\n", dir->srcPath, name, dir->destPath, name);
+    }
+    releaseDir(dir);
+    free(name);
 }
 
 void add_item(Files item) {
+    if (useRing) {
+        if (!ringPush(&itemRing, &item, &sigInt)) { // Full and SIGINT came
+            dropItem(&item);
+        }
+        return;
+    }
     pthread_mutex_lock(&the_mutex); // lock
     while(buffer.count == *maxBuffer) pthread_cond_wait(&condp, &the_mutex); // buffer is full
     buffer.buffer[buffer.last] = item; // add item to buffer
@@ -338,16 +1712,113 @@ void add_item(Files item) {
 }
 
 Files remove_item() {
+    if (useRing) {
+        return removeRingItem();
+    }
     pthread_mutex_lock(&the_mutex);
-    while(buffer.count == 0 && buffer.doneFlag == 0) pthread_cond_wait(&condc, &the_mutex); // buffer is empty and producer is not done
+    // buffer is empty, no chunks are left and producer is not done or a taken file may still be split
+    while(buffer.count == 0 && splitJobs == NULL && (buffer.doneFlag == 0 || pendingSplits > 0)) pthread_cond_wait(&condc, &the_mutex);
+    if(splitJobs != NULL) { // chunks of a large file come first, so it is done soon
+        Files item = takeChunk();
+        pthread_mutex_unlock(&the_mutex); // unlock
+        return item;
+    }
     if(buffer.count > 0) { // buffer is not empty
         Files item = buffer.buffer[buffer.head]; // get item from buffer
         buffer.head = (buffer.head + 1) % buffer.bufferSize; // increment head for next item
         buffer.count--; // decrement count
+        item.job = NULL;
+        pendingSplits++; // until the worker decides whether to split it
         pthread_cond_signal(&condp); // signal to producer
         pthread_mutex_unlock(&the_mutex); // unlock
         return item; // return item
     }
     pthread_mutex_unlock(&the_mutex); // unlock
-    return (Files){-1, -1, "", ""}; // return empty item
-}
\ No newline at end of file
+    return (Files){.dir = NULL}; // return empty item
+}
+
+Files removeRingItem() {
+    while (1) {
+        if (batchNext < batchCount) {
+            return ringBatch[batchNext++];
+        }
+        if (splitJobs != NULL) { // chunks of a large file come first, so it is done soon
+            pthread_mutex_lock(&the_mutex);
+            if (splitJobs != NULL) {
+                Files item = takeChunk();
+                pthread_mutex_unlock(&the_mutex);
+                return item;
+            }
+            pthread_mutex_unlock(&the_mutex);
+        }
+        if (refillBatch() > 0) {
+            continue;
+        }
+        // ring is empty, no chunks are left and producer is done and no taken file can be split any more
+        if (buffer.doneFlag == 1 && pendingSplits == 0 && splitJobs == NULL && ringCount(&itemRing) == 0) {
+            return (Files){.dir = NULL}; // return empty item
+        }
+        // Announce the sleep before looking again, a producer that adds an item after this wakes us
+        int epoch = ringPrepareSleep(&itemRing);
+        ringSleep(&itemRing, epoch, ringCount(&itemRing) == 0 && splitJobs == NULL && (buffer.doneFlag == 0 || pendingSplits > 0));
+    }
+}
+
+Files takeChunk() {
+    fileJob *job = splitJobs;
+    Files item = {.srcFd = job->srcFd, .destFd = job->destFd, .job = job};
+    item.offset = job->nextChunk * chunkSize;
+    item.length = job->size - item.offset < chunkSize ? job->size - item.offset : chunkSize;
+    if (++job->nextChunk == job->chunks) {
+        splitJobs = job->next; // every chunk is taken
+    }
+    return item;
+}
+
+void wakeWorkers() {
+    pthread_cond_broadcast(&condc);
+    if (useRing) {
+        ringWakeAll(&itemRing);
+    }
+}
+
+long queuedItems() {
+    return useRing ? ringCount(&itemRing) : buffer.count;
+}
+
+int refillBatch() {
+    int max = ringBatchSize(&itemRing, numberOfWorkers);
+    // Count the items as taken before taking them, so no worker leaves while one may still be split
+    pendingSplits += max;
+    batchCount = ringPopBatch(&itemRing, ringBatch, max);
+    batchNext = 0;
+    if (batchCount < max && atomic_fetch_sub(&pendingSplits, max - batchCount) == max - batchCount && buffer.doneFlag == 1) {
+        pthread_mutex_lock(&the_mutex);
+        wakeWorkers();
+        pthread_mutex_unlock(&the_mutex);
+    }
+    return batchCount;
+}
+
+int tryRemoveItem(Files *item) {
+    if (useRing) {
+        if (batchNext < batchCount || refillBatch() > 0) {
+            *item = ringBatch[batchNext++];
+            return 1;
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&the_mutex);
+    if (buffer.count == 0) {
+        pthread_mutex_unlock(&the_mutex);
+        return 0;
+    }
+    *item = buffer.buffer[buffer.head];
+    buffer.head = (buffer.head + 1) % buffer.bufferSize;
+    buffer.count--;
+    item->job = NULL;
+    pendingSplits++; // until the worker decides whether to split it
+    pthread_cond_signal(&condp);
+    pthread_mutex_unlock(&the_mutex);
+    return 1;
+}
@@ -1,19 +1,64 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <stdatomic.h>
 
 #define PATH_SIZE 1024
+#define NAME_SIZE 256 // NAME_MAX and the terminating zero
+#define PACK_FILES 64 // Most small files in one item
+#define PACK_SMALL (64 * 1024) // Files up to this size are packed
 
 pthread_mutex_t the_mutex; // Mutex for synchronization between threads
 pthread_cond_t condc, condp; // Condition variables for controlling if buffer is full or empty
 pthread_mutex_t flag; // Mutex for SIGINT
-pthread_barrier_t workerBarrier; // Barrier for workers
 
 
+// Directory being copied, kept open while its entries or subdirectories still need it
 typedef struct {
+    int srcFd; // File descriptor for source directory
+    int destFd; // File descriptor for destination directory
+    char *srcPath; // Source directory path, for messages
+    char *destPath; // Destination directory path, for messages
+    atomic_int refs; // Walker reading it, tasks of its subdirectories and its files in the buffer
+} dirHandle;
+
+// Large file split into chunks, closed and reported by the worker that finishes its last chunk
+typedef struct fileJob {
     int srcFd; // File descriptor for source file
     int destFd; // File descriptor for destination file
-    char srcName[PATH_SIZE]; // Source file name
-    char destName[PATH_SIZE]; // Destination file name
+    dirHandle *dir; // Directory of the file, released with the job
+    char *name; // File name inside dir
+    long size; // Size of the source file
+    int chunks; // Number of chunks
+    int nextChunk; // First chunk no worker took yet, guarded by the_mutex
+    atomic_int remaining; // Chunks not copied yet
+    atomic_long bytes; // Bytes copied by all chunks
+    int method; // Copy method of the last chunk
+    int revalidate; // --resume found a destination the interrupted run may have written, chunks are compared
+    long mtimeSec; // Modification time of the source, for the journal records of the chunks
+    long mtimeNsec;
+    struct fileJob *next; // Next job with chunks left, guarded by the_mutex
+} fileJob;
+
+// Small files of one directory queued as one item, each file holds a reference of the directory
+typedef struct {
+    int count;
+    char *names[PACK_FILES];
+    long sizes[PACK_FILES]; // Sizes the walker saw
+} filePack;
+
+// File waiting in the buffer, the worker opens it relative to its directory so queued files hold no descriptors
+typedef struct {
+    dirHandle *dir; // Directory of the file, NULL for the empty item
+    char *name; // File name inside dir
+    int srcFd; // File descriptor for source file, opened by the worker
+    int destFd; // File descriptor for destination file, opened by the worker
+    fileJob *job; // Job of a chunk, NULL for a whole file
+    filePack *pack; // Small files copied together, name is NULL then
+    int revalidate; // --resume found a destination the interrupted run may have written, it is compared block by block
+    long offset; // Start of the chunk
+    long length; // Length of the chunk
 } Files;
 
 typedef struct {
@@ -22,10 +67,31 @@ typedef struct {
     int count; // Number of items in buffer
     int head; // Head of buffer
     int last; // Last of buffer
-    int doneFlag; // Done flag
+    atomic_int doneFlag; // Done flag, read without the_mutex by workers of the ring
 } Buffer;
 
+// Subdirectory waiting for a walker
+typedef struct {
+    dirHandle *parent; // Directory that holds it
+    char name[NAME_SIZE]; // Name inside the parent
+} dirTask;
+
+// Tasks of one walker, the owner takes the newest one and other walkers steal the oldest one
+typedef struct {
+    pthread_mutex_t lock;
+    dirTask **tasks;
+    int head; // Oldest task
+    int tail; // One after the newest task
+    int capacity;
+} taskDeque;
+
 Buffer buffer;
+_Atomic(fileJob *) splitJobs = NULL; // Jobs with chunks left, workers take these before new files, changed under the_mutex
+atomic_int pendingSplits = 0; // Whole files taken by workers that may still be split
+int openDirs = 0; // Open directory handles, guarded by dirMutex
+int dirLimit = 0; // Walkers wait for a handle to close above this while the buffer still holds files
+pthread_mutex_t dirMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dirCond = PTHREAD_COND_INITIALIZER; // Signaled when a directory handle is closed
 
 // Initialize buffer
 void initBuffer(int size ) {
@@ -38,12 +104,40 @@ void initBuffer(int size ) {
     buffer.doneFlag = 0;
 }
 
+// Close the directory when the last task, file or walker that needs it is done
+void releaseDir(dirHandle *dir) {
+    if (atomic_fetch_sub(&dir->refs, 1) == 1) {
+        close(dir->srcFd);
+        close(dir->destFd);
+        free(dir->srcPath);
+        free(dir->destPath);
+        free(dir);
+        pthread_mutex_lock(&dirMutex);
+        openDirs--;
+        pthread_cond_signal(&dirCond);
+        pthread_mutex_unlock(&dirMutex);
+    }
+}
+
+// Release the directory and the names of an item that will not be copied
+void dropItem(Files *item) {
+    if (item->pack != NULL) {
+        for (int i = 0; i < item->pack->count; i++) {
+            releaseDir(item->dir);
+            free(item->pack->names[i]);
+        }
+        free(item->pack);
+        return;
+    }
+    releaseDir(item->dir);
+    free(item->name);
+}
+
 // Clean buffer
 void clean() {
     while(buffer.count > 0) {
-        // Close file descriptors
-        close(buffer.buffer[buffer.head].srcFd);
-        close(buffer.buffer[buffer.head].destFd);
+        // Release the directories of files that were not copied
+        dropItem(&buffer.buffer[buffer.head]);
         buffer.count--;
         buffer.head = (buffer.head + 1) % buffer.bufferSize;
     }
@@ -51,4 +145,62 @@ void clean() {
     if(buffer.buffer != NULL) {
         free(buffer.buffer);
     }
-}
\ No newline at end of file
+}
+
+// Initialize an empty deque
+void initDeque(taskDeque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->tasks = NULL;
+    deque->head = 0;
+    deque->tail = 0;
+    deque->capacity = 0;
+}
+
+// Add a task at the owner's end
+void pushTask(taskDeque *deque, dirTask *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        // Move the tasks to the front before growing, steals leave room there
+        memmove(deque->tasks, deque->tasks + deque->head, sizeof(dirTask *) * (deque->tail - deque->head));
+        deque->tail -= deque->head;
+        deque->head = 0;
+        if (deque->tail == deque->capacity) {
+            deque->capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+            deque->tasks = realloc(deque->tasks, sizeof(dirTask *) * deque->capacity);
+            if (deque->tasks == NULL) {
+                perror("Error allocating directory tasks");
+                exit(1);
+            }
+        }
+    }
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Take the newest task, the owner keeps working deep in its own subtree
+dirTask *popTask(taskDeque *deque) {
+    dirTask *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        task = deque->tasks[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Take the oldest task of another walker, it is the closest to the root so it has the most work under it
+dirTask *stealTask(taskDeque *deque) {
+    dirTask *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        task = deque->tasks[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Free an empty deque
+void destroyDeque(taskDeque *deque) {
+    free(deque->tasks);
+    pthread_mutex_destroy(&deque->lock);
+}
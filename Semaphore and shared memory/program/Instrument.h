@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Contention counters of the parking semaphores. Every sem_wait/sem_post of
+ * the owners and attendants goes through semWait/semPost with the id of the
+ * semaphore. Each thread counts into its own record, the records are merged
+ * when the run ends or when the sampler dumps a snapshot. Child processes
+ * count into a record the parent set aside in shared memory before the fork,
+ * so a child never allocates or takes countersMutex, and snapshots include
+ * the children while they run.
+ */
+
+// Ids of the semaphores, the same id is used for every lot
+#define SEM_ENTRANCE 0
+#define SEM_CONTROL(type) (1 + (type))
+#define SEM_NEW_VEHICLE(type) (3 + (type))
+#define SEM_IN_CHARGE(type) (5 + (type))
+#define SEM_QUEUE_LOCK(type) (7 + (type))
+#define SEM_WAKE(type) (9 + (type))
+#define SEM_KINDS 11
+
+#define HIST_BUCKETS 40 // Bucket b counts waits below 2^b ns, bucket 0 the waits that did not block
+
+const char *semNames[SEM_KINDS] = {"parkEntrance", "controlAutomobileParking", "controlPickupParking", "newAutomobile", "newPickup",
+    "inChargeforAutomobile", "inChargeforPickup", "queueLockAutomobile", "queueLockPickup", "wakeAutomobile", "wakePickup"};
+
+// Counters of one semaphore, written by one thread and read by the sampler
+typedef struct {
+    atomic_long acquired; // Successful waits
+    atomic_long contended; // Waits that had to block
+    atomic_long timeouts; // Timed waits that gave up
+    atomic_long posts;
+    atomic_long waitNs; // Total time spent blocked
+    atomic_long maxNs;
+    atomic_long hist[HIST_BUCKETS];
+} semCounters;
+
+typedef struct threadCounters {
+    semCounters sems[SEM_KINDS];
+    struct threadCounters *next;
+} threadCounters;
+
+int instrument = 0; // Count semaphore operations, off unless --instrument or --json is given
+threadCounters *allCounters = NULL; // Records of every thread that used a semaphore
+threadCounters *sharedCounters = NULL; // Records of the child processes in shared memory
+int sharedCount = 0;
+pthread_mutex_t countersMutex = PTHREAD_MUTEX_INITIALIZER;
+__thread threadCounters *myCounters = NULL;
+
+/* Monotonic time in nanoseconds */
+long nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/* Hold countersMutex across fork, so no child starts with it locked by the sampler */
+void lockCounters() {
+    pthread_mutex_lock(&countersMutex);
+}
+
+/* Release countersMutex in the parent and in the child after fork */
+void unlockCounters() {
+    pthread_mutex_unlock(&countersMutex);
+}
+
+/* Register the fork handlers, before any thread that merges the counters starts */
+void initCounters() {
+    if (pthread_atfork(lockCounters, unlockCounters, unlockCounters) != 0) {
+        perror("Could not register fork handlers");
+        exit(1);
+    }
+}
+
+/* Let snapshots read the count records of the child processes in shared memory while they run */
+void shareCounters(threadCounters *records, int count) {
+    pthread_mutex_lock(&countersMutex);
+    sharedCounters = records;
+    sharedCount = count;
+    pthread_mutex_unlock(&countersMutex);
+}
+
+/* Record of the calling thread, created on its first semaphore operation */
+threadCounters *counters() {
+    if (myCounters == NULL) {
+        myCounters = calloc(1, sizeof(threadCounters));
+        if (myCounters == NULL) {
+            perror("Could not allocate counters");
+            exit(1);
+        }
+        pthread_mutex_lock(&countersMutex);
+        myCounters->next = allCounters;
+        allCounters = myCounters;
+        pthread_mutex_unlock(&countersMutex);
+    }
+    return myCounters;
+}
+
+/* Add to a counter only this thread writes, no locked instruction is needed */
+void bump(atomic_long *counter, long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* Count one acquisition and the time it blocked */
+void recordWait(int id, long ns, int contended) {
+    semCounters *c = &counters()->sems[id];
+    int bucket = 0;
+    while (bucket < HIST_BUCKETS - 1 && (1L << bucket) <= ns) {
+        bucket++;
+    }
+    bump(&c->acquired, 1);
+    bump(&c->contended, contended);
+    bump(&c->waitNs, ns);
+    bump(&c->hist[bucket], 1);
+    if (ns > atomic_load_explicit(&c->maxNs, memory_order_relaxed)) {
+        atomic_store_explicit(&c->maxNs, ns, memory_order_relaxed);
+    }
+}
+
+/* sem_wait that counts how long it blocked */
+int semWait(sem_t *sem, int id) {
+    if (!instrument) {
+        return sem_wait(sem);
+    }
+    if (sem_trywait(sem) == 0) {
+        recordWait(id, 0, 0);
+        return 0;
+    }
+    long start = nowNs();
+    int result = sem_wait(sem);
+    if (result == 0) {
+        recordWait(id, nowNs() - start, 1);
+    }
+    return result;
+}
+
+/* sem_trywait that counts its acquisitions */
+int semTryWait(sem_t *sem, int id) {
+    int result = sem_trywait(sem);
+    if (instrument && result == 0) {
+        recordWait(id, 0, 0);
+    }
+    return result;
+}
+
+/* sem_timedwait that counts how long it blocked and its timeouts */
+int semTimedWait(sem_t *sem, const struct timespec *deadline, int id) {
+    if (!instrument) {
+        return sem_timedwait(sem, deadline);
+    }
+    if (sem_trywait(sem) == 0) {
+        recordWait(id, 0, 0);
+        return 0;
+    }
+    long start = nowNs();
+    int result = sem_timedwait(sem, deadline);
+    if (result == 0) {
+        recordWait(id, nowNs() - start, 1);
+    } else if (errno == ETIMEDOUT) {
+        bump(&counters()->sems[id].timeouts, 1);
+    }
+    return result;
+}
+
+/* sem_post that counts the posts */
+int semPost(sem_t *sem, int id) {
+    if (instrument) {
+        bump(&counters()->sems[id].posts, 1);
+    }
+    return sem_post(sem);
+}
+
+/* Copy the records of the exited child processes to the records of this process, the shared memory can be freed then */
+void adoptCounters() {
+    pthread_mutex_lock(&countersMutex); // In one hold, so no snapshot counts a child twice or not at all
+    for (int i = 0; i < sharedCount; i++) {
+        threadCounters *record = malloc(sizeof(threadCounters));
+        if (record == NULL) {
+            perror("Could not allocate counters");
+            exit(1);
+        }
+        memcpy(record, &sharedCounters[i], sizeof(threadCounters));
+        record->next = allCounters;
+        allCounters = record;
+    }
+    sharedCounters = NULL;
+    sharedCount = 0;
+    pthread_mutex_unlock(&countersMutex);
+}
+
+/* Add one record to the sums */
+void addCounters(semCounters *total, threadCounters *t) {
+    for (int i = 0; i < SEM_KINDS; i++) {
+        semCounters *from = &t->sems[i];
+        total[i].acquired += atomic_load_explicit(&from->acquired, memory_order_relaxed);
+        total[i].contended += atomic_load_explicit(&from->contended, memory_order_relaxed);
+        total[i].timeouts += atomic_load_explicit(&from->timeouts, memory_order_relaxed);
+        total[i].posts += atomic_load_explicit(&from->posts, memory_order_relaxed);
+        total[i].waitNs += atomic_load_explicit(&from->waitNs, memory_order_relaxed);
+        long max = atomic_load_explicit(&from->maxNs, memory_order_relaxed);
+        if (max > total[i].maxNs) {
+            total[i].maxNs = max;
+        }
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            total[i].hist[b] += atomic_load_explicit(&from->hist[b], memory_order_relaxed);
+        }
+    }
+}
+
+/* Sum the records of all threads and of the running child processes */
+void mergeCounters(semCounters *total) {
+    memset(total, 0, sizeof(semCounters) * SEM_KINDS);
+    pthread_mutex_lock(&countersMutex);
+    for (threadCounters *t = allCounters; t != NULL; t = t->next) {
+        addCounters(total, t);
+    }
+    for (int i = 0; i < sharedCount; i++) {
+        addCounters(total, &sharedCounters[i]);
+    }
+    pthread_mutex_unlock(&countersMutex);
+}
+
+/* Upper bound in microseconds of the wait below which the given fraction of acquisitions fall */
+double percentileUs(semCounters *c, double fraction) {
+    long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += c->hist[b];
+        if (seen >= fraction * c->acquired) {
+            long bound = b == 0 ? 0 : 1L << b;
+            return (bound < c->maxNs ? bound : c->maxNs) / 1000.0;
+        }
+    }
+    return c->maxNs / 1000.0;
+}
+
+/* Print the merged counters of every semaphore that was used */
+void printContention() {
+    semCounters total[SEM_KINDS];
+    mergeCounters(total);
+    printf("\n---------------CONTENTION--------------------\n");
+    printf("%-26s %10s %10s %9s %10s %10s %10s %10s %10s\n", "Semaphore", "Acquired", "Contended", "Timeouts", "Mean us", "P50 us", "P99 us", "Max us", "Posts");
+    for (int i = 0; i < SEM_KINDS; i++) {
+        semCounters *c = &total[i];
+        if (c->acquired == 0 && c->posts == 0 && c->timeouts == 0) {
+            continue;
+        }
+        printf("%-26s %10ld %10ld %9ld %10.1f %10.1f %10.1f %10.1f %10ld\n", semNames[i], c->acquired, c->contended, c->timeouts,
+            c->acquired > 0 ? c->waitNs / 1000.0 / c->acquired : 0, percentileUs(c, 0.5), percentileUs(c, 0.99), c->maxNs / 1000.0, c->posts);
+    }
+}
+
+/* Write the merged counters as the "semaphores" member of a JSON object */
+void printContentionJson(FILE *out) {
+    semCounters total[SEM_KINDS];
+    mergeCounters(total);
+    fprintf(out, "\"semaphores\":{");
+    for (int i = 0, first = 1; i < SEM_KINDS; i++) {
+        semCounters *c = &total[i];
+        if (c->acquired == 0 && c->posts == 0 && c->timeouts == 0) {
+            continue;
+        }
+        fprintf(out, "%s\"%s\":{\"acquired\":%ld,\"contended\":%ld,\"timeouts\":%ld,\"posts\":%ld,\"wait_ns\":%ld,\"max_ns\":%ld,\"hist\":[",
+            first ? "" : ",", semNames[i], c->acquired, c->contended, c->timeouts, c->posts, c->waitNs, c->maxNs);
+        int last = HIST_BUCKETS - 1;
+        while (last > 0 && c->hist[last] == 0) {
+            last--;
+        }
+        for (int b = 0; b <= last; b++) {
+            fprintf(out, "%s%ld", b == 0 ? "" : ",", c->hist[b]);
+        }
+        fprintf(out, "]}");
+        first = 0;
+    }
+    fprintf(out, "}");
+}
+
+/* Free the records of all threads */
+void freeCounters() {
+    while (allCounters != NULL) {
+        threadCounters *next = allCounters->next;
+        free(allCounters);
+        allCounters = next;
+    }
+}
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Event driven mode of the parking. Vehicles are small records instead of
+ * threads and every step of an owner or attendant is an event on a virtual
+ * clock. A fixed pool of workers applies the events with the same lot rules
+ * as carOwner/carAttendant (utility.h) and schedules what follows.
+ *
+ * Events are applied in causal order. Every event but an arrival and all it
+ * schedules touch only the lot of its vehicle, so each lot keeps its own
+ * heap and its events run one at a time in time order, while the events of
+ * other lots before the next arrival run in parallel. An arrival reaches its
+ * routed lot and the lots it spills over to, which the free spots of those
+ * lots decide, or every lot with least loaded routing. It waits until none
+ * of them is busy and holds them while it runs, the other lots go on. Each
+ * lot then sees the same sequence of events as with one worker, and so does
+ * the result.
+ */
+
+// Kinds of events
+#define EVENT_ARRIVAL 0 // Owner arrives at the free parking
+#define EVENT_VALET 1 // Attendant moves a reserved vehicle to regular parking
+#define EVENT_GIVE_UP 2 // Deadline of an owner waiting for regular parking
+#define EVENT_DEPARTURE 3 // Vehicle leaves regular parking
+
+typedef struct {
+    long id;
+    int type; // AUTOMOBILE or PICKUP
+    parkingLot *lot; // Lot the vehicle parked in
+    double arrival; // Simulated second the owner arrived
+    double dwell; // Seconds the vehicle stays in regular parking, 0 for forever
+    int patience; // Seconds the owner waits when regular parking is full
+    double parkedAt; // Simulated second the vehicle entered regular parking
+    int slot; // Slot in the waiting queue, -1 if the owner never queued
+    atomic_int inQueue; // 1 while the slot is held, the first of the valet and give up events frees it
+    atomic_int refs; // Pending events of the vehicle, freed when it drops to 0
+} vehicle;
+
+typedef struct {
+    double time;
+    long seq; // Keeps events of the same time in the order they were scheduled
+    int kind;
+    vehicle *v;
+} simEvent;
+
+// Binary min heap of pending events
+typedef struct {
+    simEvent *events;
+    int count;
+    int capacity;
+} eventHeap;
+
+typedef struct {
+    long arrivals; // Number of vehicles to simulate
+    int workers; // Number of worker threads
+    double rate; // Poisson arrivals per simulated second
+    double meanDwell; // Mean seconds in regular parking, 0 keeps vehicles forever
+    FILE *trace; // Arrivals read from "<time> <type> <dwell>" lines instead of the Poisson process
+    int patience; // Owners wait up to this many seconds when regular parking is full
+    long seed; // Seed of the arrival process, the same seed gives the same workload
+    FILE *record; // Generated arrivals are written here in the trace format
+} simConfig;
+
+// Counters of one lot or of the arrivals, merged in lot order when the simulation ends
+typedef struct {
+    long arrived[2];
+    long noFreeSpace[2];
+    long parked[2];
+    long gaveUp[2];
+    long departed[2];
+    long queued[2]; // Owners that joined the waiting queue
+    long served[2]; // Owners that got a spot from the waiting queue
+    double waitTime; // Seconds owners spent in free parking waiting for regular parking
+    double occupied; // Spot seconds used in regular parking by vehicles that left
+    double parkedForever; // Sum of parkedAt of vehicles that never leave
+    long foreverCount;
+    long events;
+} simStats;
+
+simConfig sim;
+pthread_mutex_t simMutex; // Guards the event heaps, the lot flags and the arrival process
+pthread_cond_t simCond; // Signaled when an event is finished or the simulation ends
+eventHeap *lotEvents = NULL; // Pending events of each lot
+int *lotBusy = NULL; // 1 while a worker applies an event of the lot or an arrival holds it
+simStats *lotStats = NULL; // Counters of each lot, the last one counts the arrivals
+simEvent nextArrival; // The arrival process only runs one vehicle ahead
+int arrivalPending = 0; // nextArrival holds a vehicle
+int arrivalRunning = 0; // An arrival is applied, the next one waits for it
+int arrivalFirst = 0; // First lot held by the running arrival
+int arrivalHeld = 0; // Number of lots from arrivalFirst on held by the running arrival
+long eventSeq = 0;
+int inFlight = 0; // Events taken by workers and not finished yet
+int idleWorkers = 0; // Workers waiting for an event to become runnable
+long generated = 0; // Vehicles created by the arrival process
+double lastArrival = 0; // Time of the last generated arrival
+double simClock = 0; // Latest event time taken by a worker
+unsigned short arrivalSeed[3]; // State of the arrival process
+unsigned short patienceSeed[3]; // Patience of the owners, a stream of its own so a replayed trace gets the same with the same seed
+
+/* Returns 1 if event a comes before event b */
+int earlier(simEvent *a, simEvent *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+/* Add an event to a heap, simMutex must be held */
+void pushEvent(eventHeap *heap, double time, int kind, vehicle *v) {
+    if (heap->count == heap->capacity) {
+        heap->capacity = heap->capacity == 0 ? 1024 : heap->capacity * 2;
+        heap->events = realloc(heap->events, sizeof(simEvent) * heap->capacity);
+        if (heap->events == NULL) {
+            perror("Could not grow event queue");
+            exit(1);
+        }
+    }
+    simEvent ev = {time, eventSeq++, kind, v};
+    int i = heap->count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (earlier(&heap->events[parent], &ev)) {
+            break;
+        }
+        heap->events[i] = heap->events[parent];
+        i = parent;
+    }
+    heap->events[i] = ev;
+}
+
+/* Remove the earliest event from a heap, simMutex must be held */
+simEvent popEvent(eventHeap *heap) {
+    simEvent top = heap->events[0];
+    simEvent last = heap->events[--heap->count];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count && earlier(&heap->events[child + 1], &heap->events[child])) {
+            child++;
+        }
+        if (earlier(&last, &heap->events[child])) {
+            break;
+        }
+        heap->events[i] = heap->events[child];
+        i = child;
+    }
+    heap->events[i] = last;
+    return top;
+}
+
+/* Exponentially distributed random number with the given mean */
+double exponential(double mean, unsigned short seed[3]) {
+    return -mean * log(1.0 - erand48(seed));
+}
+
+/* Schedule the next arrival of the Poisson process or the trace, simMutex must be held */
+void scheduleNextArrival() {
+    if (generated == sim.arrivals) {
+        return;
+    }
+    vehicle *v = malloc(sizeof(vehicle));
+    if (v == NULL) {
+        perror("Could not allocate vehicle");
+        exit(1);
+    }
+    v->id = generated;
+    v->slot = -1;
+    atomic_init(&v->inQueue, 0);
+    atomic_init(&v->refs, 1); // Held by the arrival event
+    if (sim.trace != NULL) {
+        if (fscanf(sim.trace, "%lf %d %lf", &v->arrival, &v->type, &v->dwell) != 3 || v->type < 0 || v->type > 1) {
+            free(v);
+            sim.arrivals = generated; // Trace is over
+            return;
+        }
+        if (v->arrival < lastArrival) { // Keep the clock moving forward on an unsorted trace
+            v->arrival = lastArrival;
+        }
+    } else {
+        v->arrival = lastArrival + exponential(1.0 / sim.rate, arrivalSeed);
+        v->type = erand48(arrivalSeed) < 0.5 ? AUTOMOBILE : PICKUP; // Same as rand() % 2
+        v->dwell = sim.meanDwell > 0 ? exponential(sim.meanDwell, arrivalSeed) : 0;
+    }
+    // Drawn with the arrival so the workload does not depend on which worker handles the vehicle
+    v->patience = (int)(erand48(patienceSeed) * (sim.patience + 1));
+    if (sim.record != NULL) {
+        fprintf(sim.record, "%.17g %d %.17g\n", v->arrival, v->type, v->dwell); // Exact, the replay must see the same times
+    }
+    lastArrival = v->arrival;
+    generated++;
+    nextArrival = (simEvent){v->arrival, eventSeq++, EVENT_ARRIVAL, v};
+    arrivalPending = 1;
+}
+
+/* Number of lots the next arrival reaches from *first on, simMutex must be held.
+   Returns 0 if one of them is busy, its event may change where the vehicle parks */
+int arrivalReach(int *first) {
+    vehicle *v = nextArrival.v;
+    if (routePolicy == ROUTE_LEAST_LOADED) { // Routing compares every lot
+        for (int i = 0; i < lotCount; i++) {
+            if (lotBusy[i]) {
+                return 0;
+            }
+        }
+        *first = 0;
+        return lotCount;
+    }
+    *first = routeVehicle(v->id, v->type);
+    for (int i = 0; i < lotCount; i++) {
+        int lot = (*first + i) % lotCount;
+        if (lotBusy[lot]) {
+            return 0;
+        }
+        if (atomic_load(&parkingLots[lot].vehicles[v->type].freeSpots) > 0) { // Same test as ownerArrives, it parks here
+            return i + 1;
+        }
+    }
+    return lotCount;
+}
+
+/* Take the earliest event that no event in flight can change, simMutex must be held.
+   Returns 0 if every pending event waits for one in flight */
+int takeEvent(simEvent *ev) {
+    int pick = -1;
+    for (int i = 0; i < lotCount; i++) {
+        // The lot must be idle and the next arrival must not come first, it may park in this lot
+        if (lotEvents[i].count > 0 && !lotBusy[i] && (!arrivalPending || earlier(&lotEvents[i].events[0], &nextArrival))
+                && (pick == -1 || earlier(&lotEvents[i].events[0], &lotEvents[pick].events[0]))) {
+            pick = i;
+        }
+    }
+    if (pick != -1) {
+        *ev = popEvent(&lotEvents[pick]);
+        lotBusy[pick] = 1;
+        return 1;
+    }
+    // Idle lots have nothing earlier, the lots the arrival reaches must be idle too
+    if (arrivalPending && !arrivalRunning && (arrivalHeld = arrivalReach(&arrivalFirst)) > 0) {
+        for (int i = 0; i < arrivalHeld; i++) {
+            lotBusy[(arrivalFirst + i) % lotCount] = 1;
+        }
+        *ev = nextArrival;
+        arrivalPending = 0;
+        arrivalRunning = 1;
+        scheduleNextArrival();
+        return 1;
+    }
+    return 0;
+}
+
+/* Drop the reference of a handled event to the vehicle */
+void dropVehicle(vehicle *v) {
+    if (atomic_fetch_sub(&v->refs, 1) == 1) {
+        free(v);
+    }
+}
+
+/* Waiting vehicle got a regular spot, keep it alive for the valet event scheduled by the departure */
+void simGrant(void *owner) {
+    atomic_fetch_add(&((vehicle *)owner)->refs, 1);
+}
+
+/* Apply one event to the lot, follow-up events go to next[] and their count is returned */
+int processEvent(simEvent *ev, simStats *stats, simEvent *next) {
+    vehicle *v = ev->v;
+    vehicle *waiter;
+    int count = 0;
+    stats->events++;
+    switch (ev->kind) {
+        case EVENT_ARRIVAL:
+            stats->arrived[v->type]++;
+            switch (parkVehicle(v->id, v->type, &v->lot)) {
+                case SPOT_RESERVED:
+                    atomic_fetch_add(&v->refs, 1);
+                    next[count++] = (simEvent){ev->time, 0, EVENT_VALET, v};
+                    break;
+                case REGULAR_FULL:
+                    atomic_fetch_add(&v->refs, 1);
+                    if (useQueue) {
+                        atomic_store(&v->inQueue, 1); // Before joining, a departure may grant the spot right away
+                        if (!joinQueue(v->lot, v->type, v, &v->slot)) {
+                            atomic_store(&v->inQueue, 0);
+                            next[count++] = (simEvent){ev->time, 0, EVENT_VALET, v}; // A spot was released meanwhile
+                            break;
+                        }
+                        stats->queued[v->type]++;
+                    }
+                    next[count++] = (simEvent){ev->time + v->patience, 0, EVENT_GIVE_UP, v};
+                    break;
+                default:
+                    stats->noFreeSpace[v->type]++;
+                    break;
+            }
+            break;
+        case EVENT_VALET:
+            // The spot was reserved on arrival or handed over by a departure, so regular parking always has room here
+            attendantMoves(v->lot, v->type);
+            stats->parked[v->type]++;
+            if (v->slot != -1) {
+                stats->served[v->type]++;
+                stats->waitTime += ev->time - v->arrival;
+                if (atomic_exchange(&v->inQueue, 0)) {
+                    leaveQueue(v->lot, v->type, v->slot);
+                }
+            }
+            v->parkedAt = ev->time;
+            if (v->dwell > 0) {
+                atomic_fetch_add(&v->refs, 1);
+                next[count++] = (simEvent){ev->time + v->dwell, 0, EVENT_DEPARTURE, v};
+            } else {
+                stats->parkedForever += ev->time;
+                stats->foreverCount++;
+            }
+            break;
+        case EVENT_GIVE_UP:
+            // A granted owner may have left the queue in its valet event already
+            if (v->slot == -1 || (atomic_exchange(&v->inQueue, 0) && leaveQueue(v->lot, v->type, v->slot) == WAIT_TIMEOUT)) {
+                ownerLeavesFree(v->lot, v->type);
+                stats->gaveUp[v->type]++;
+                stats->waitTime += ev->time - v->arrival;
+            }
+            break;
+        case EVENT_DEPARTURE:
+            waiter = ownerLeavesRegular(v->lot, v->type);
+            if (waiter != NULL) { // simGrant already took the reference of this event
+                next[count++] = (simEvent){ev->time, 0, EVENT_VALET, waiter};
+            }
+            stats->departed[v->type]++;
+            stats->occupied += ev->time - v->parkedAt;
+            break;
+    }
+    dropVehicle(v);
+    return count;
+}
+
+/* Worker thread of the simulation */
+void* simWorker(void* arg) {
+    simEvent next[2];
+
+    pthread_mutex_lock(&simMutex);
+    while (1) {
+        simEvent ev;
+        if (!takeEvent(&ev)) {
+            // Nothing pending is only the end if no other worker can still schedule events
+            if (inFlight == 0) {
+                break;
+            }
+            idleWorkers++;
+            pthread_cond_wait(&simCond, &simMutex);
+            idleWorkers--;
+            continue;
+        }
+        if (ev.time > simClock) {
+            simClock = ev.time;
+        }
+        inFlight++;
+        int lot = ev.kind == EVENT_ARRIVAL ? lotCount : ev.v->lot - parkingLots;
+        pthread_mutex_unlock(&simMutex);
+
+        int count = processEvent(&ev, &lotStats[lot], next);
+
+        pthread_mutex_lock(&simMutex);
+        for (int i = 0; i < count; i++) { // Events that follow stay in the lot the vehicle parked in
+            pushEvent(&lotEvents[next[i].v->lot - parkingLots], next[i].time, next[i].kind, next[i].v);
+        }
+        if (lot == lotCount) {
+            for (int i = 0; i < arrivalHeld; i++) {
+                lotBusy[(arrivalFirst + i) % lotCount] = 0;
+            }
+            arrivalRunning = 0;
+        } else {
+            lotBusy[lot] = 0;
+        }
+        inFlight--;
+        if (idleWorkers > 0) {
+            pthread_cond_broadcast(&simCond);
+        }
+    }
+    pthread_cond_broadcast(&simCond);
+    pthread_mutex_unlock(&simMutex);
+    return NULL;
+}
+
+/* Run the event driven simulation and print its statistics */
+int runSimulation() {
+    pthread_t threads[sim.workers];
+    simStats total;
+    struct timespec start, end;
+    memset(&total, 0, sizeof(total));
+    lotEvents = calloc(lotCount, sizeof(eventHeap));
+    lotBusy = calloc(lotCount, sizeof(int));
+    lotStats = calloc(lotCount + 1, sizeof(simStats));
+    if (lotEvents == NULL || lotBusy == NULL || lotStats == NULL) {
+        perror("Could not allocate event queues");
+        exit(1);
+    }
+
+    seedState(arrivalSeed, sim.seed, 0);
+    seedState(patienceSeed, sim.seed, 1);
+    pthread_mutex_init(&simMutex, NULL);
+    pthread_cond_init(&simCond, NULL);
+    onGrant = simGrant;
+    scheduleNextArrival();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < sim.workers; i++) {
+        if (pthread_create(&threads[i], NULL, simWorker, NULL) != 0) {
+            perror("Thread creation failed\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < sim.workers; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            perror("Thread join failed\n");
+            exit(1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; i <= lotCount; i++) {
+        for (int t = 0; t < 2; t++) {
+            total.arrived[t] += lotStats[i].arrived[t];
+            total.noFreeSpace[t] += lotStats[i].noFreeSpace[t];
+            total.parked[t] += lotStats[i].parked[t];
+            total.gaveUp[t] += lotStats[i].gaveUp[t];
+            total.departed[t] += lotStats[i].departed[t];
+            total.queued[t] += lotStats[i].queued[t];
+            total.served[t] += lotStats[i].served[t];
+        }
+        total.waitTime += lotStats[i].waitTime;
+        total.occupied += lotStats[i].occupied;
+        total.parkedForever += lotStats[i].parkedForever;
+        total.foreverCount += lotStats[i].foreverCount;
+        total.events += lotStats[i].events;
+    }
+    // Vehicles that never leave occupy their spot until the end
+    total.occupied += total.foreverCount * simClock - total.parkedForever;
+    long regularCapacity = 0;
+    long waited = 0;
+    for (int i = 0; i < lotCount; i++) {
+        regularCapacity += parkingLots[i].vehicles[AUTOMOBILE].capacity[1] + parkingLots[i].vehicles[PICKUP].capacity[1];
+    }
+    for (int t = 0; t < 2; t++) {
+        waited += total.served[t] + total.gaveUp[t];
+    }
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("\n---------------SIMULATION--------------------\n");
+    printf("Workers: %d - Lots: %d - Arrivals: %ld - Events: %ld - Seed: %ld\n", sim.workers, lotCount, generated, total.events, sim.seed);
+    for (int t = 0; t < 2; t++) {
+        printf("%s: arrived %ld - parked in regular %ld - free parking full %ld - regular parking full %ld - departed %ld\n",
+            parkingLots[0].vehicles[t].name, total.arrived[t], total.parked[t], total.noFreeSpace[t], total.gaveUp[t], total.departed[t]);
+        if (useQueue) {
+            printf("%s: joined waiting queue %ld - got a spot from the queue %ld\n", parkingLots[0].vehicles[t].name, total.queued[t], total.served[t]);
+        }
+    }
+    printf("Regular parking utilization: %.1f%% - Mean wait when regular parking was full: %.3f s\n",
+        simClock > 0 ? 100.0 * total.occupied / (simClock * regularCapacity) : 0, waited > 0 ? total.waitTime / waited : 0);
+    printf("Simulated time: %.1f s - Wall time: %.3f s - Arrivals per second: %.0f\n", simClock, wall, wall > 0 ? generated / wall : 0);
+
+    pthread_mutex_destroy(&simMutex);
+    pthread_cond_destroy(&simCond);
+    onGrant = NULL;
+    for (int i = 0; i < lotCount; i++) {
+        free(lotEvents[i].events);
+    }
+    free(lotEvents);
+    free(lotBusy);
+    free(lotStats);
+    return 0;
+}
@@ -3,202 +3,589 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "utility.h"
+#include "Simulation.h"
 
-#define MAX_AUTOMOBILE 8
-#define MAX_PICKUP 4
 #define MAX_VEHICLES 30
 
-// Semaphores
-sem_t newPickup, newAutomobile; // To notify attendants that a new vehicle is parked in free parking
-sem_t inChargeforPickup, inChargeforAutomobile; // Waits for the valet to park the vehicle from free spot to permament spot
-sem_t controlAutomobileParking, controlPickupParking; // It prevents race condition while moving car from free parking to regular parking
-sem_t parkEntrance; // To prevent race condition while waiting for entrance to free parking
+// State of a run the owners and attendants share, in the shared mapping when they are processes
+typedef struct {
+    atomic_int finishThreads; // To exit from carAttendant threads after vehicle limit is reached
+    atomic_int finish;
+    atomic_long valetMoves; // Vehicles moved by all attendants
+    atomic_long valetWakeups; // Wakeups of attendants that moved at least one vehicle
+} runState;
 
-// Counters for free park
-volatile int mFree_automobile = MAX_AUTOMOBILE;
-volatile int parkedAutomobile = MAX_AUTOMOBILE;
-volatile int waitingQueueAutomobile = MAX_AUTOMOBILE;
-volatile int mFree_pickup = MAX_PICKUP;
-volatile int parkedPickup = MAX_PICKUP;
-volatile int waitingQueuePickup = MAX_PICKUP;
+runState *run = NULL;
 
-// To exit from carAttendant threads after vehicle limit is reached
-int finishThreads = 0;
-int finish = 0;
+int patience = 2; // Owners wait up to this many seconds when regular parking is full
+long seed; // Seed of every random stream, owner i draws from stream i
+int *ownerTypes = NULL; // Vehicle type of each owner, read from --replay or drawn from the seed
+FILE *recordOut = NULL; // Owner types are written here in the trace format
+FILE *replayIn = NULL;
+int attendantsPerType = 1; // Attendant threads of each vehicle type in each lot
+int maxBatch = 8; // Vehicles one attendant moves per wakeup
+
+// Queues sampled while the parking runs with --instrument
+#define QUEUE_FREE 0 // Vehicles in free parking
+#define QUEUE_VALET 1 // Vehicles waiting for an attendant, value of newVehicle
+#define QUEUE_WAITING 2 // Owners in the waiting queue for regular parking
+#define QUEUE_KINDS 3
+
+// Length of one queue over the samples
+typedef struct {
+    long samples;
+    double sum;
+    long max;
+} queueStat;
+
+const char *queueNames[QUEUE_KINDS] = {"freeParking", "valetPending", "waitingQueue"};
+queueStat queueStats[QUEUE_KINDS][2];
+int sampleMs = 100; // Milliseconds between samples of the queues
+FILE *jsonOut = NULL; // Counters and queue lengths are written here as one JSON object per sample
+atomic_int stopSampler = 0;
+long samplerStart;
+
+// Work of one thread of the stress test
+typedef struct {
+    long operations; // Owner visits to run
+    unsigned short seed[3];
+    long violations; // Counters seen outside their limits
+} stressArgs;
+
+/* Run the parking with one thread, or one process with --processes, for each vehicle and attendant */
+void runThreads();
+
+/* Run the stress test of the spot counters with both sync modes, also with processes if asked */
+int runStress(int threads, long operations, int processes);
+
+/* Sample the queues and dump the counters until stopSampler is set */
+void* queueSampler(void* arg);
+
+/* Print usage of the program */
+void usage(const char *name);
 
 void* carOwner(void* arg) {
-    int vehicleType = rand() % 2; // 0 for automobile, 1 for pickup
-    // int vehicleType = 0;
-    if (vehicleType == 0) { // Automobile
-        sem_wait(&parkEntrance); 
-        sem_wait(&controlAutomobileParking);
-        if (mFree_automobile > 0) {
-            mFree_automobile--;
-            printf("Automobile parked in free parking. Remaining spots in free parking: %d. Remaining Spots in regular parking: %d\n", mFree_automobile, parkedAutomobile);
-            sem_post(&newAutomobile);
-            sem_post(&parkEntrance);
-            if(waitingQueueAutomobile == 0) {
-                sem_post(&controlAutomobileParking);
-                int randTime = rand() % 3;
+    long id = (long)(intptr_t)arg;
+    unsigned short state[3];
+    seedState(state, seed, id + 1);
+    int vehicleType = ownerTypes[id]; // 0 for automobile, 1 for pickup
+    int parked = 0; // 1 once the attendant moved the vehicle to regular parking
+    parkingLot *lot;
+    switch (parkVehicle(id, vehicleType, &lot)) {
+        case SPOT_RESERVED:
+            semPost(&lot->vehicles[vehicleType].newVehicle, SEM_NEW_VEHICLE(vehicleType));
+            semWait(&lot->vehicles[vehicleType].inCharge, SEM_IN_CHARGE(vehicleType));
+            parked = 1;
+            break;
+        case REGULAR_FULL: {
+            int randTime = nrand48(state) % (patience + 1);
+            if (!useQueue) {
                 sleep(randTime);
-                sem_wait(&controlAutomobileParking);
-                mFree_automobile++;
-                printf("Regular parking is still full. Automobile is leaving from free parking. Remaining spots in free parking %d\n", mFree_automobile);
-                sem_post(&controlAutomobileParking);
-            } else {
-                waitingQueueAutomobile--;
-                sem_post(&controlAutomobileParking);
-                sem_wait(&inChargeforAutomobile);
+            } else if (ownerWaits(lot, vehicleType, randTime) == WAIT_GRANTED) {
+                // A leaving vehicle handed its spot over, the attendant parks this one
+                semPost(&lot->vehicles[vehicleType].newVehicle, SEM_NEW_VEHICLE(vehicleType));
+                semWait(&lot->vehicles[vehicleType].inCharge, SEM_IN_CHARGE(vehicleType));
+                parked = 1;
+                break;
             }
-        } else {
-            sem_post(&controlAutomobileParking);
-            sem_post(&parkEntrance);
-            printf("No space for another automobile in free parking.\n");
-        }
-    } else {
-        sem_wait(&parkEntrance);
-        sem_wait(&controlPickupParking);
-        if (mFree_pickup > 0) {
-            mFree_pickup--;
-            printf("Pickup parked in free parking. Remaining spots in free parking: %d. Remaining Spots in regular parking: %d\n", mFree_pickup, parkedPickup);
-            sem_post(&newPickup);
-            sem_post(&parkEntrance);
-            if(waitingQueuePickup == 0) {
-                sem_post(&controlPickupParking);
-                int randTime = rand() % 3;
-                sleep(randTime);
-                sem_wait(&controlPickupParking);
-                mFree_pickup++;
-                printf("Regular parking is still full. Pickup is leaving from free parking. Remaining spots in free parking. %d\n", mFree_pickup);
-                sem_post(&controlPickupParking);
-            } else {
-                waitingQueuePickup--;
-                sem_post(&controlPickupParking);
-                sem_wait(&inChargeforPickup);
-            }
-        } else {
-            sem_post(&controlPickupParking);
-            sem_post(&parkEntrance);
-            printf("No space for another pickup in free parking.\n");
+            ownerLeavesFree(lot, vehicleType);
+            break;
         }
+        default: // No space in free parking of any lot
+            break;
     }
-    finishThreads++;
-    if(finishThreads == MAX_VEHICLES - 2) {
-        finish = 1;
-        sem_post(&newAutomobile);
-        sem_post(&controlAutomobileParking);
-        sem_post(&newPickup);
-        sem_post(&controlPickupParking);
+    if (parked) {
+        // The vehicle stays a while and leaves, its spot goes to the first waiting owner
+        sleep(nrand48(state) % (patience + 1));
+        ownerLeavesRegular(lot, vehicleType);
     }
-    pthread_exit(NULL);
+    if(atomic_fetch_add(&run->finishThreads, 1) + 1 == MAX_VEHICLES - 2) {
+        run->finish = 1;
+        for (int i = 0; i < lotCount; i++) {
+            semPost(&parkingLots[i].vehicles[AUTOMOBILE].newVehicle, SEM_NEW_VEHICLE(AUTOMOBILE));
+            semPost(&parkingLots[i].vehicles[PICKUP].newVehicle, SEM_NEW_VEHICLE(PICKUP));
+        }
+    }
+    return NULL;
 }
 
 void* carAttendant(void* arg) {
-    intptr_t argInt = (intptr_t)arg;
-    if(argInt == 0) {
-        while(1) {
-            sem_wait(&newAutomobile);
-            sem_wait(&controlAutomobileParking);
-            if(parkedAutomobile == 0 || finish == 1) {
-                sem_post(&inChargeforAutomobile);
-                sem_post(&controlAutomobileParking);
-                break;
-            }
-            mFree_automobile++;
-            parkedAutomobile--;
-            printf("Automobile parked in regular parking. Remaining spots in free parking: %d. Remaining Spots in regular parking: %d\n", mFree_automobile, parkedAutomobile);
-            sem_post(&inChargeforAutomobile);
-            sem_post(&controlAutomobileParking);
+    intptr_t argInt = (intptr_t)arg; // Lot index * 2 + vehicle type, 0 for automobile, 1 for pickup
+    parkingLot *lot = &parkingLots[argInt / 2];
+    int type = argInt % 2;
+    while(1) {
+        semWait(&lot->vehicles[type].newVehicle, SEM_NEW_VEHICLE(type));
+        // Take the other vehicles already waiting so they are moved in the same lock hold
+        int pending = 1;
+        while (pending < maxBatch && semTryWait(&lot->vehicles[type].newVehicle, SEM_NEW_VEHICLE(type)) == 0) {
+            pending++;
         }
-    } else {
-        while(1) {
-            sem_wait(&newPickup);
-            sem_wait(&controlPickupParking);
-            if(parkedPickup == 0 || finish == 1) {
-                sem_post(&inChargeforPickup);
-                sem_post(&controlPickupParking);
-                break;
+        if (run->finish == 1) {
+            semPost(&lot->vehicles[type].newVehicle, SEM_NEW_VEHICLE(type)); // Wake the next attendant of the pool, its post may be drained above
+            semPost(&lot->vehicles[type].inCharge, SEM_IN_CHARGE(type));
+            break;
+        }
+        int moved = attendantMovesBatch(lot, type, pending);
+        atomic_fetch_add(&run->valetMoves, moved);
+        atomic_fetch_add(&run->valetWakeups, moved > 0);
+        for (int i = 0; i < pending; i++) { // Owners of the batch are signaled together
+            semPost(&lot->vehicles[type].inCharge, SEM_IN_CHARGE(type));
+        }
+        if (moved < pending) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Add one sample of every queue, summed over the lots, and write it to jsonOut */
+void sampleQueues() {
+    long lengths[QUEUE_KINDS][2];
+    memset(lengths, 0, sizeof(lengths));
+    for (int i = 0; i < lotCount; i++) {
+        for (int t = 0; t < 2; t++) {
+            vehicleLot *lot = &parkingLots[i].vehicles[t];
+            int pending;
+            sem_getvalue(&lot->newVehicle, &pending);
+            lengths[QUEUE_FREE][t] += lot->capacity[0] - atomic_load(&lot->freeSpots);
+            lengths[QUEUE_VALET][t] += pending > 0 ? pending : 0;
+            sem_wait(&lot->queueLock); // Not counted, the sampler is not an owner or attendant
+            lengths[QUEUE_WAITING][t] += lot->queueLength;
+            sem_post(&lot->queueLock);
+        }
+    }
+    for (int q = 0; q < QUEUE_KINDS; q++) {
+        for (int t = 0; t < 2; t++) {
+            queueStats[q][t].samples++;
+            queueStats[q][t].sum += lengths[q][t];
+            if (lengths[q][t] > queueStats[q][t].max) {
+                queueStats[q][t].max = lengths[q][t];
             }
-            mFree_pickup++;
-            parkedPickup--;
-            printf("Pickup parked in regular parking. Remaining spots in free parking: %d. Remaining Spots in regular parking: %d\n", mFree_pickup, parkedPickup);
-            sem_post(&inChargeforPickup);
-            sem_post(&controlPickupParking);
         }
     }
+    if (jsonOut != NULL) {
+        fprintf(jsonOut, "{\"time\":%.3f,\"queues\":{", (nowNs() - samplerStart) / 1e9);
+        for (int q = 0; q < QUEUE_KINDS; q++) {
+            fprintf(jsonOut, "%s\"%s\":[%ld,%ld]", q == 0 ? "" : ",", queueNames[q], lengths[q][AUTOMOBILE], lengths[q][PICKUP]);
+        }
+        fprintf(jsonOut, "},");
+        printContentionJson(jsonOut);
+        fprintf(jsonOut, "}\n");
+        fflush(jsonOut);
+    }
+}
+
+void* queueSampler(void* arg) {
+    struct timespec interval = {sampleMs / 1000, (sampleMs % 1000) * 1000000L};
+    while (!atomic_load(&stopSampler)) {
+        nanosleep(&interval, NULL);
+        sampleQueues();
+    }
     pthread_exit(NULL);
 }
 
-int main() {
-    srand(time(NULL)); // Seed random number generator
-    int s;
-    // Initialize semaphores
-    if (sem_init(&newAutomobile, 0, 0) == -1) {
-        perror("Could not initialize semaphore");
-        exit(1);
+/* Print the semaphore counters and the queue lengths */
+void printInstrument() {
+    printContention();
+    printf("%-26s %10s %10s %10s %10s\n", "Queue", "Samples", "Mean", "Max", "Type");
+    for (int q = 0; q < QUEUE_KINDS; q++) {
+        for (int t = 0; t < 2; t++) {
+            queueStat *stat = &queueStats[q][t];
+            printf("%-26s %10ld %10.2f %10ld %10s\n", queueNames[q], stat->samples, stat->samples > 0 ? stat->sum / stat->samples : 0,
+                stat->max, parkingLots[0].vehicles[t].name);
+        }
     }
-    if (sem_init(&newPickup, 0, 0) == -1) {
-        perror("Could not initialize semaphore");
-        exit(1);
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [--sync <atomic|sem>] [--lots <n>] [--route <hash|least>] [--sim <arrivals> [--workers <n>] [--rate <arrivals/s>] [--dwell <seconds>] [--verbose]] [--patience <seconds>] [--no-queue] [--attendants <n>] [--batch <n>]\n", name);
+    printf("       [--instrument] [--json <file>] [--interval <ms>] [--seed <n>] [--record <file>] [--replay <file>] [--automobiles <n>] [--pickups <n>]\n");
+    printf("       [--processes]\n");
+    printf("       %s --stress <threads> <operations> [--seed <n>] [--processes]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int simulate = 0;
+    int automobiles = MAX_AUTOMOBILE;
+    int pickups = MAX_PICKUP;
+    int verbose = 0;
+    int stressThreads = 0;
+    long stressOperations = 0;
+    int lots = 1;
+    int seeded = 0;
+    int processes = 0;
+    sim.workers = sysconf(_SC_NPROCESSORS_ONLN); // Only the speed depends on it, a seed or trace gives the same results with any count
+    sim.rate = 1.0;
+    sim.meanDwell = 10.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sim") == 0 && i + 1 < argc) {
+            simulate = 1;
+            sim.arrivals = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            sim.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            sim.rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--dwell") == 0 && i + 1 < argc) {
+            sim.meanDwell = atof(argv[++i]);
+        } else if ((strcmp(argv[i], "--trace") == 0 || strcmp(argv[i], "--replay") == 0) && i + 1 < argc) {
+            replayIn = fopen(argv[++i], "r");
+            if (replayIn == NULL) {
+                perror("Could not open trace");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordOut = fopen(argv[++i], "w");
+            if (recordOut == NULL) {
+                perror("Could not open trace");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = atol(argv[++i]);
+            seeded = 1;
+        } else if (strcmp(argv[i], "--automobiles") == 0 && i + 1 < argc) {
+            automobiles = atoi(argv[++i]);
+            if (automobiles < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--pickups") == 0 && i + 1 < argc) {
+            pickups = atoi(argv[++i]);
+            if (pickups < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "atomic") == 0) {
+                syncMode = SYNC_ATOMIC;
+            } else if (strcmp(argv[i], "sem") == 0) {
+                syncMode = SYNC_SEMAPHORE;
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--lots") == 0 && i + 1 < argc) {
+            lots = atoi(argv[++i]);
+            if (lots < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--route") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "hash") == 0) {
+                routePolicy = ROUTE_HASH;
+            } else if (strcmp(argv[i], "least") == 0) {
+                routePolicy = ROUTE_LEAST_LOADED;
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--stress") == 0 && i + 2 < argc) {
+            stressThreads = atoi(argv[++i]);
+            stressOperations = atol(argv[++i]);
+            if (stressThreads < 1 || stressOperations < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--patience") == 0 && i + 1 < argc) {
+            patience = atoi(argv[++i]);
+            if (patience < 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--attendants") == 0 && i + 1 < argc) {
+            attendantsPerType = atoi(argv[++i]);
+            if (attendantsPerType < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            maxBatch = atoi(argv[++i]);
+            if (maxBatch < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--instrument") == 0) {
+            instrument = 1;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            instrument = 1;
+            jsonOut = fopen(argv[++i], "w");
+            if (jsonOut == NULL) {
+                perror("Could not open JSON output");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            sampleMs = atoi(argv[++i]);
+            if (sampleMs < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--processes") == 0) {
+            processes = 1;
+        } else if (strcmp(argv[i], "--no-queue") == 0) {
+            useQueue = 0;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else {
+            usage(argv[0]);
+            exit(1);
+        }
     }
-    if (sem_init(&inChargeforAutomobile, 0, 0) == -1) {
-        perror("Could not initialize semaphore");
+    if (simulate && (sim.arrivals < 1 || sim.workers < 1 || sim.rate <= 0 || sim.meanDwell < 0)) {
+        usage(argv[0]);
         exit(1);
     }
-    if (sem_init(&inChargeforPickup, 0, 0) == -1) {
-        perror("Could not initialize semaphore");
-        exit(1);
+    if (!seeded) {
+        seed = time(NULL); // Printed with the results, so the run can be repeated with --seed
     }
-    if (sem_init(&parkEntrance, 0, 1) == -1) {
-        perror("Could not initialize semaphore");
-        exit(1);
+    if (processes && stressThreads == 0 && !simulate) {
+        processShared = 1; // Owners and attendants are processes, the stress test switches over after its thread runs
+        setvbuf(stdout, NULL, _IOLBF, 0); // Lines of different processes must not be mixed
     }
-    if (sem_init(&controlAutomobileParking, 0, 1) == -1) {
-        perror("Could not initialize semaphore");
-        exit(1);
+    // Initialize lots and their semaphores
+    initLots(lots, automobiles, pickups);
+
+    int status = 0;
+    pthread_t sampler;
+    if (stressThreads > 0) {
+        instrument = 0; // The stress test measures the bare cost of the counters
+    } else if (instrument) {
+        initCounters();
+        samplerStart = nowNs();
+        if (pthread_create(&sampler, NULL, queueSampler, NULL) != 0) {
+            perror("Thread creation failed\n");
+            exit(1);
+        }
     }
-    if (sem_init(&controlPickupParking, 0, 1) == -1) {
-        perror("Could not initialize semaphore");
-        exit(1);
+    if (stressThreads > 0) {
+        printEvents = 0;
+        useQueue = 0; // Owners leave at once in the stress test, so only the counters are measured
+        status = runStress(stressThreads, stressOperations, processes);
+    } else if (simulate) {
+        printEvents = verbose; // Millions of events are not printed unless asked
+        sim.patience = patience;
+        sim.seed = seed;
+        sim.trace = replayIn;
+        sim.record = recordOut;
+        runSimulation();
+    } else {
+        runThreads();
     }
-
-    pthread_t threads[MAX_VEHICLES];
-    s = pthread_create(&threads[0], NULL, carAttendant, (void *)0); // One thread for each attendant
-    if(s != 0)
-    {
-        perror("Thread creation failed\n");
-        exit(1);
+    if (replayIn != NULL) {
+        fclose(replayIn);
     }
-    s = pthread_create(&threads[1], NULL, carAttendant, (void *)1);
-    if(s != 0)
-    {
-        perror("Thread creation failed\n");
-        exit(1);
+    if (recordOut != NULL) {
+        fclose(recordOut);
     }
+    if (instrument) {
+        atomic_store(&stopSampler, 1);
+        if (pthread_join(sampler, NULL) != 0) {
+            perror("Thread join failed\n");
+            exit(1);
+        }
+        sampleQueues(); // Final snapshot holds the counters of the whole run
+        printInstrument();
+        freeCounters();
+        if (jsonOut != NULL) {
+            fclose(jsonOut);
+        }
+    }
+    // Cleanup
+    destroyLots();
+    return status;
+}
 
-    for (int i = 2; i < MAX_VEHICLES; i++) {
-        s = pthread_create(&threads[i], NULL, carOwner, NULL); // Multiple car owners
-        if(s != 0)
-        {
+/* Start body(arg) as a thread, or as a child process in processShared mode that counts into record */
+void startWorker(pthread_t *thread, pid_t *pid, void* (*body)(void*), void* arg, threadCounters *record) {
+    if (!processShared) {
+        if (pthread_create(thread, NULL, body, arg) != 0) {
             perror("Thread creation failed\n");
             exit(1);
         }
+        return;
+    }
+    *pid = fork();
+    if (*pid == -1) {
+        perror("Fork failed");
+        exit(1);
+    }
+    if (*pid == 0) {
+        if (record != NULL) {
+            myCounters = record; // Set aside by the parent, counters() never allocates or locks here
+        }
+        body(arg);
+        exit(0);
     }
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        s = pthread_join(threads[i], NULL);
-        if(s != 0)
-        {
+}
+
+/* Wait for a worker from startWorker */
+void joinWorker(pthread_t thread, pid_t pid) {
+    if (!processShared) {
+        if (pthread_join(thread, NULL) != 0) {
             perror("Thread join failed\n");
             exit(1);
         }
+        return;
     }
-    // Cleanup
-    sem_destroy(&newAutomobile);
-    sem_destroy(&newPickup);
-    sem_destroy(&inChargeforAutomobile);
-    sem_destroy(&inChargeforPickup);
-    sem_destroy(&parkEntrance);
-    sem_destroy(&controlAutomobileParking);
-    sem_destroy(&controlPickupParking);
-    return 0;
-}
\ No newline at end of file
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("Wait failed");
+        exit(1);
+    }
+}
+
+void runThreads() {
+    int attendants = 2 * lotCount * attendantsPerType; // attendantsPerType threads for each vehicle type of each lot
+    int owners = MAX_VEHICLES - 2;
+    pthread_t threads[attendants + owners];
+    pid_t pids[attendants + owners];
+    int types[owners];
+    unsigned short state[3];
+    double arrival, dwell;
+    seedState(state, seed, 0);
+    // Owners run at once, so only the type of each trace line is used
+    for (int i = 0; i < owners; i++) {
+        if (replayIn == NULL || fscanf(replayIn, "%lf %d %lf", &arrival, &types[i], &dwell) != 3 || types[i] < 0 || types[i] > 1) {
+            types[i] = erand48(state) < 0.5 ? AUTOMOBILE : PICKUP;
+        }
+        if (recordOut != NULL) {
+            fprintf(recordOut, "0 %d 0\n", types[i]);
+        }
+    }
+    ownerTypes = types; // Children get a copy with fork
+    run = sharedAlloc("run", sizeof(runState));
+    threadCounters *records = processShared && instrument ? sharedAlloc("counters", sizeof(threadCounters) * (attendants + owners)) : NULL;
+    if (records != NULL) {
+        shareCounters(records, attendants + owners);
+    }
+    fflush(stdout); // Children must not print the buffer they inherit again
+    for (int i = 0; i < attendants; i++) {
+        startWorker(&threads[i], &pids[i], carAttendant, (void *)(intptr_t)(i % (2 * lotCount)), records ? &records[i] : NULL);
+    }
+    for (int i = 0; i < owners; i++) {
+        // Multiple car owners
+        startWorker(&threads[attendants + i], &pids[attendants + i], carOwner, (void *)(intptr_t)i, records ? &records[attendants + i] : NULL);
+    }
+    for (int i = 0; i < attendants + owners; i++) {
+        joinWorker(threads[i], pids[i]);
+    }
+    if (records != NULL) {
+        adoptCounters(); // Every child exited, keep copies for the final snapshot
+        sharedFree(records, sizeof(threadCounters) * (attendants + owners));
+    }
+    printf("%s per vehicle type: %d - Vehicles moved: %ld in %ld wakeups - Seed: %ld\n", processShared ? "Attendant processes" : "Attendants",
+        attendantsPerType, atomic_load(&run->valetMoves), atomic_load(&run->valetWakeups), seed);
+    sharedFree(run, sizeof(runState));
+}
+
+/* Check that the counters of a vehicle type are inside their limits */
+int spotsInRange(vehicleLot *lot) {
+    int freeSpots = atomic_load(&lot->freeSpots);
+    int regularSpots = atomic_load(&lot->regularSpots);
+    int waitingQueue = atomic_load(&lot->waitingQueue);
+    return freeSpots >= 0 && freeSpots <= lot->capacity[0] && regularSpots >= 0 && regularSpots <= lot->capacity[1] &&
+        waitingQueue >= 0 && waitingQueue <= lot->capacity[1];
+}
+
+/* Stress thread, owners arrive and leave back to back on both vehicle types */
+void* stressWorker(void* arg) {
+    stressArgs *args = (stressArgs *)arg;
+    for (long i = 0; i < args->operations; i++) {
+        int type = erand48(args->seed) < 0.5 ? AUTOMOBILE : PICKUP;
+        parkingLot *lot;
+        switch (parkVehicle(nrand48(args->seed), type, &lot)) {
+            case SPOT_RESERVED:
+                if (attendantMoves(lot, type) == 0) { // A reserved spot must always be there
+                    args->violations++;
+                }
+                ownerLeavesRegular(lot, type);
+                break;
+            case REGULAR_FULL:
+                ownerLeavesFree(lot, type);
+                break;
+        }
+        if (lot != NULL && !spotsInRange(&lot->vehicles[type])) {
+            args->violations++;
+        }
+    }
+    return NULL;
+}
+
+int runStress(int threads, long operations, int processes) {
+    const char *names[2] = {"atomic", "semaphore"};
+    const char *placements[2] = {"threads", "processes"};
+    int modes[2] = {SYNC_ATOMIC, SYNC_SEMAPHORE};
+    double opsPerSecond[2][2];
+    long failures = 0;
+
+    for (int p = 0; p < 1 + processes; p++) {
+        if (p == 1) {
+            // Same lots again in a shared mapping with process shared semaphores
+            int automobiles = parkingLots[0].vehicles[AUTOMOBILE].capacity[0];
+            int pickups = parkingLots[0].vehicles[PICKUP].capacity[0];
+            int lots = lotCount;
+            destroyLots();
+            processShared = 1;
+            initLots(lots, automobiles, pickups);
+        }
+        for (int m = 0; m < 2; m++) {
+            pthread_t ids[threads];
+            pid_t pids[threads];
+            stressArgs *args = sharedAlloc("stress", sizeof(stressArgs) * threads);
+            struct timespec start, end;
+            long violations = 0;
+
+            syncMode = modes[m];
+            for (int l = 0; l < lotCount; l++) {
+                for (int t = 0; t < 2; t++) {
+                    vehicleLot *v = &parkingLots[l].vehicles[t];
+                    atomic_store(&v->freeSpots, v->capacity[0]);
+                    atomic_store(&v->regularSpots, v->capacity[1]);
+                    atomic_store(&v->waitingQueue, v->capacity[1]);
+                }
+            }
+            fflush(stdout);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < threads; i++) {
+                args[i].operations = operations / threads;
+                args[i].violations = 0;
+                seedState(args[i].seed, seed, i);
+                startWorker(&ids[i], &pids[i], stressWorker, &args[i], NULL);
+            }
+            for (int i = 0; i < threads; i++) {
+                joinWorker(ids[i], pids[i]);
+                violations += args[i].violations;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            sharedFree(args, sizeof(stressArgs) * threads);
+            // Every vehicle left, so every counter must be back at its capacity
+            for (int l = 0; l < lotCount; l++) {
+                for (int t = 0; t < 2; t++) {
+                    vehicleLot *v = &parkingLots[l].vehicles[t];
+                    if (atomic_load(&v->freeSpots) != v->capacity[0] || atomic_load(&v->regularSpots) != v->capacity[1] ||
+                            atomic_load(&v->waitingQueue) != v->capacity[1]) {
+                        printf("Lot %d %s counters did not return to capacity: free %d, regular %d, waiting queue %d\n", l, v->name,
+                            atomic_load(&v->freeSpots), atomic_load(&v->regularSpots), atomic_load(&v->waitingQueue));
+                        violations++;
+                    }
+                }
+            }
+            double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            opsPerSecond[p][m] = (operations / threads) * threads / seconds;
+            printf("%s: %d %s - %d lots - %ld owner visits in %.3f s - %.0f visits/s - invariant violations: %ld\n",
+                names[m], threads, placements[p], lotCount, (operations / threads) * threads, seconds, opsPerSecond[p][m], violations);
+            failures += violations;
+        }
+        printf("atomic / semaphore speedup with %s: %.2fx\n", placements[p], opsPerSecond[p][0] / opsPerSecond[p][1]);
+    }
+    if (processes) {
+        for (int m = 0; m < 2; m++) {
+            printf("%s threads / processes speedup: %.2fx\n", names[m], opsPerSecond[0][m] / opsPerSecond[1][m]);
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
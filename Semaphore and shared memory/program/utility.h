@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "Instrument.h"
+
+#define MAX_AUTOMOBILE 8
+#define MAX_PICKUP 4
+
+#define AUTOMOBILE 0
+#define PICKUP 1
+
+// Result of an owner arriving at the free parking
+#define NO_FREE_SPACE 0 // Free parking is full, owner leaves
+#define SPOT_RESERVED 1 // A regular spot is reserved, attendant will move the vehicle
+#define REGULAR_FULL 2 // Vehicle is in free parking but regular parking is full
+
+int printEvents = 1; // Print every parking event, the simulation turns it off
+
+// How the spot counters are protected
+#define SYNC_ATOMIC 0 // Compare and swap on the counters, no lock
+#define SYNC_SEMAPHORE 1 // Every change under the lot entrance and the control semaphore of the type
+int syncMode = SYNC_ATOMIC;
+
+// How the first lot of a vehicle is chosen
+#define ROUTE_HASH 0 // Hash of the vehicle id
+#define ROUTE_LEAST_LOADED 1 // Lot with the most free parking spots for the vehicle type
+int routePolicy = ROUTE_HASH;
+
+// Result of waiting in the queue for a regular spot
+#define WAIT_TIMEOUT 0 // Deadline passed, the owner leaves free parking
+#define WAIT_GRANTED 1 // A leaving vehicle handed its regular spot to the owner
+
+int useQueue = 1; // Owners wait in a FIFO queue when regular parking is full, 0 for the old sleep and leave
+void (*onGrant)(void *owner) = NULL; // Called under queueLock when the simulation hands a spot to a waiting vehicle
+
+// Owner waiting in free parking for a regular spot
+typedef struct {
+    sem_t wake; // Posted when a regular spot is handed to this owner
+    int granted; // Set under queueLock before wake is posted
+    int next; // Next slot in the queue or in the unused list, -1 at the end
+    int prev; // Previous slot in the queue, -1 at the head
+    void *owner; // Vehicle record of the simulation
+} waitSlot;
+
+// Counters and semaphores of one vehicle type in one lot
+typedef struct {
+    const char *name; // Name at the start of a message
+    const char *noun; // Name inside a message
+    int capacity[2]; // Spots in free and regular parking
+    atomic_int freeSpots; // Remaining spots in free parking
+    atomic_int regularSpots; // Remaining spots in regular parking
+    atomic_int waitingQueue; // Regular spots not promised to an owner yet, never above regularSpots
+    sem_t control; // Guards the counters in SYNC_SEMAPHORE mode, was controlAutomobileParking/controlPickupParking
+    sem_t newVehicle; // Posted for the attendant when a vehicle waits in free parking, was newAutomobile/newPickup
+    sem_t inCharge; // Posted by the attendant when the vehicle is in regular parking, was inChargeforAutomobile/inChargeforPickup
+    sem_t queueLock; // Guards the waiting queue
+    waitSlot *slots; // One per free parking spot, since every waiting owner holds one
+    int queueHead; // First waiting owner, -1 if nobody waits
+    int queueTail; // Last waiting owner
+    int unusedSlot; // First unused slot
+    int queueLength; // Owners in the waiting queue
+} vehicleLot;
+
+// One independent parking lot with its own spots, attendants and locks
+typedef struct {
+    int id;
+    vehicleLot vehicles[2]; // AUTOMOBILE and PICKUP
+    sem_t entrance; // To prevent race condition while waiting for entrance to free parking, was parkEntrance
+} parkingLot;
+
+parkingLot *parkingLots = NULL;
+int lotCount = 1;
+size_t lotsSize = 0; // Bytes of the lots and their waiting queues
+int processShared = 0; // Lots live in shared memory with process shared semaphores, set by --processes
+
+/* Zeroed memory for the lots, mapped from a POSIX shared memory object in processShared mode */
+void *sharedAlloc(const char *name, size_t size) {
+    if (!processShared) {
+        void *memory = calloc(1, size);
+        if (memory == NULL) {
+            perror("Could not allocate memory");
+            exit(1);
+        }
+        return memory;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/parking_%d_%s", getpid(), name);
+    int fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) {
+        perror("Could not create shared memory");
+        exit(1);
+    }
+    shm_unlink(path); // Children get the mapping through fork, so the name is not needed after this
+    if (ftruncate(fd, size) == -1) {
+        perror("Could not size shared memory");
+        exit(1);
+    }
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("Could not map shared memory");
+        exit(1);
+    }
+    close(fd);
+    return memory;
+}
+
+/* Release memory from sharedAlloc */
+void sharedFree(void *memory, size_t size) {
+    if (processShared) {
+        munmap(memory, size);
+    } else {
+        free(memory);
+    }
+}
+
+/* Initialize a semaphore or stop the program */
+void initSemaphore(sem_t *sem, unsigned int value) {
+    if (sem_init(sem, processShared, value) == -1) {
+        perror("Could not initialize semaphore");
+        exit(1);
+    }
+}
+
+/* Create count lots, each with the given free and regular capacity per vehicle type */
+void initLots(int count, int automobiles, int pickups) {
+    const char *names[2] = {"Automobile", "Pickup"};
+    const char *nouns[2] = {"automobile", "pickup"};
+    int capacity[2] = {automobiles, pickups};
+    lotCount = count;
+    // Waiting queues follow the lots in the same block, so one mapping holds the whole state
+    lotsSize = count * (sizeof(parkingLot) + (automobiles + pickups) * sizeof(waitSlot));
+    parkingLots = sharedAlloc("lots", lotsSize);
+    waitSlot *slots = (waitSlot *)(parkingLots + count);
+    for (int i = 0; i < count; i++) {
+        parkingLot *lot = &parkingLots[i];
+        lot->id = i;
+        initSemaphore(&lot->entrance, 1);
+        for (int t = 0; t < 2; t++) {
+            vehicleLot *v = &lot->vehicles[t];
+            v->name = names[t];
+            v->noun = nouns[t];
+            v->capacity[0] = v->capacity[1] = capacity[t];
+            atomic_init(&v->freeSpots, capacity[t]);
+            atomic_init(&v->regularSpots, capacity[t]);
+            atomic_init(&v->waitingQueue, capacity[t]);
+            initSemaphore(&v->control, 1);
+            initSemaphore(&v->newVehicle, 0);
+            initSemaphore(&v->inCharge, 0);
+            initSemaphore(&v->queueLock, 1);
+            v->slots = slots;
+            slots += capacity[t];
+            for (int j = 0; j < capacity[t]; j++) {
+                initSemaphore(&v->slots[j].wake, 0);
+                v->slots[j].next = j + 1 < capacity[t] ? j + 1 : -1;
+            }
+            v->queueHead = v->queueTail = -1;
+            v->queueLength = 0;
+            v->unusedSlot = 0;
+        }
+    }
+}
+
+/* Destroy the semaphores and free the lots */
+void destroyLots() {
+    for (int i = 0; i < lotCount; i++) {
+        sem_destroy(&parkingLots[i].entrance);
+        for (int t = 0; t < 2; t++) {
+            sem_destroy(&parkingLots[i].vehicles[t].control);
+            sem_destroy(&parkingLots[i].vehicles[t].newVehicle);
+            sem_destroy(&parkingLots[i].vehicles[t].inCharge);
+            sem_destroy(&parkingLots[i].vehicles[t].queueLock);
+            for (int j = 0; j < parkingLots[i].vehicles[t].capacity[0]; j++) {
+                sem_destroy(&parkingLots[i].vehicles[t].slots[j].wake);
+            }
+        }
+    }
+    sharedFree(parkingLots, lotsSize);
+}
+
+/* Seed the erand48 state of one stream, the same seed and stream always give the same numbers */
+void seedState(unsigned short state[3], long seed, long stream) {
+    unsigned long mixed = (unsigned long)seed * 6364136223846793005UL + (unsigned long)stream * 1442695040888963407UL + 1;
+    state[0] = mixed >> 16;
+    state[1] = mixed >> 32;
+    state[2] = mixed >> 48;
+}
+
+/* Start of every message, names the lot when there is more than one */
+void printLot(parkingLot *lot) {
+    if (lotCount > 1) {
+        printf("[Lot %d] ", lot->id);
+    }
+}
+
+// Take one spot from the counter if any is left, returns 0 if it is already zero
+int takeSpot(atomic_int *counter) {
+    int value = atomic_load_explicit(counter, memory_order_relaxed);
+    while (value > 0) {
+        if (atomic_compare_exchange_weak_explicit(counter, &value, value - 1, memory_order_acq_rel, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Take up to count spots from the counter with one compare and swap, returns how many were taken
+int takeSpots(atomic_int *counter, int count) {
+    int value = atomic_load_explicit(counter, memory_order_relaxed);
+    while (value > 0) {
+        int taken = value < count ? value : count;
+        if (atomic_compare_exchange_weak_explicit(counter, &value, value - taken, memory_order_acq_rel, memory_order_relaxed)) {
+            return taken;
+        }
+    }
+    return 0;
+}
+
+// Give one spot back to the counter
+void releaseSpot(atomic_int *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_release);
+}
+
+// Give count spots back to the counter
+void releaseSpots(atomic_int *counter, int count) {
+    atomic_fetch_add_explicit(counter, count, memory_order_release);
+}
+
+// Semaphore mode takes the same locks as the original owner and attendant, atomic mode takes none
+void lockLot(parkingLot *lot, int type, int entrance) {
+    if (syncMode == SYNC_SEMAPHORE) {
+        if (entrance) {
+            semWait(&lot->entrance, SEM_ENTRANCE);
+        }
+        semWait(&lot->vehicles[type].control, SEM_CONTROL(type));
+    }
+}
+
+void unlockLot(parkingLot *lot, int type, int entrance) {
+    if (syncMode == SYNC_SEMAPHORE) {
+        semPost(&lot->vehicles[type].control, SEM_CONTROL(type));
+        if (entrance) {
+            semPost(&lot->entrance, SEM_ENTRANCE);
+        }
+    }
+}
+
+// Owner takes a free parking spot of the lot and reserves a regular spot if one is left
+int ownerArrives(parkingLot *parking, int type) {
+    vehicleLot *lot = &parking->vehicles[type];
+    int result;
+    lockLot(parking, type, 1);
+    if (!takeSpot(&lot->freeSpots)) {
+        result = NO_FREE_SPACE;
+    } else if (takeSpot(&lot->waitingQueue)) {
+        result = SPOT_RESERVED;
+    } else {
+        result = REGULAR_FULL;
+    }
+    unlockLot(parking, type, 1);
+    if (printEvents && result != NO_FREE_SPACE) {
+        printLot(parking);
+        printf("%s parked in free parking. Remaining spots in free parking: %d. Remaining Spots in regular parking: %d\n", lot->name, atomic_load(&lot->freeSpots), atomic_load(&lot->regularSpots));
+    }
+    return result;
+}
+
+// Owner gives up waiting for regular parking and leaves the free parking
+void ownerLeavesFree(parkingLot *parking, int type) {
+    vehicleLot *lot = &parking->vehicles[type];
+    lockLot(parking, type, 0);
+    releaseSpot(&lot->freeSpots);
+    unlockLot(parking, type, 0);
+    if (printEvents) {
+        printLot(parking);
+        printf("Regular parking is still full. %s is leaving from free parking. Remaining spots in free parking %d\n", lot->name, atomic_load(&lot->freeSpots));
+    }
+}
+
+// Attendant moves up to count reserved vehicles to regular parking in one lock hold, returns how many were moved
+int attendantMovesBatch(parkingLot *parking, int type, int count) {
+    vehicleLot *lot = &parking->vehicles[type];
+    lockLot(parking, type, 0);
+    int moved = takeSpots(&lot->regularSpots, count);
+    releaseSpots(&lot->freeSpots, moved);
+    unlockLot(parking, type, 0);
+    if (printEvents && moved > 0) {
+        printLot(parking);
+        if (moved == 1) {
+            printf("%s parked in regular parking. Remaining spots in free parking: %d. Remaining Spots in regular parking: %d\n", lot->name, atomic_load(&lot->freeSpots), atomic_load(&lot->regularSpots));
+        } else {
+            printf("%d %ss parked in regular parking. Remaining spots in free parking: %d. Remaining Spots in regular parking: %d\n", moved, lot->noun, atomic_load(&lot->freeSpots), atomic_load(&lot->regularSpots));
+        }
+    }
+    return moved;
+}
+
+// Attendant moves a vehicle from free parking to regular parking, returns 0 if regular parking is full
+int attendantMoves(parkingLot *parking, int type) {
+    return attendantMovesBatch(parking, type, 1);
+}
+
+// Vehicle leaves regular parking. Its spot goes to the first waiting owner, or can be reserved again if nobody waits.
+// Returns the owner record of the waiter that got the spot, NULL if there was none
+void *ownerLeavesRegular(parkingLot *parking, int type) {
+    vehicleLot *lot = &parking->vehicles[type];
+    void *owner = NULL;
+    int granted = -1;
+    lockLot(parking, type, 0);
+    // regularSpots first so waitingQueue never passes it
+    releaseSpot(&lot->regularSpots);
+    if (!useQueue) { // Nobody joins the queue, so the spot is free for the next reservation
+        releaseSpot(&lot->waitingQueue);
+    } else {
+        semWait(&lot->queueLock, SEM_QUEUE_LOCK(type));
+        if (lot->queueHead != -1) {
+            // Hand the spot over directly, so a new arrival cannot take it from the waiters
+            waitSlot *slot = &lot->slots[lot->queueHead];
+            granted = lot->queueHead;
+            lot->queueHead = slot->next;
+            if (lot->queueHead == -1) {
+                lot->queueTail = -1;
+            } else {
+                lot->slots[lot->queueHead].prev = -1;
+            }
+            slot->granted = 1;
+            lot->queueLength--;
+            owner = slot->owner;
+            if (onGrant != NULL) {
+                onGrant(owner);
+            } else {
+                semPost(&slot->wake, SEM_WAKE(type));
+            }
+        } else {
+            releaseSpot(&lot->waitingQueue);
+        }
+        semPost(&lot->queueLock, SEM_QUEUE_LOCK(type));
+    }
+    unlockLot(parking, type, 0);
+    if (printEvents) {
+        printLot(parking);
+        printf("%s left regular parking. Remaining Spots in regular parking: %d\n", lot->name, atomic_load(&lot->regularSpots));
+        if (granted != -1) {
+            printLot(parking);
+            printf("Waiting %s got the regular spot.\n", lot->noun);
+        }
+    }
+    return owner;
+}
+
+// Owner in free parking joins the end of the waiting queue. The slot is stored in *index before any grant can see it,
+// -1 if a spot was reserved meanwhile. Returns 1 if the owner is queued
+int joinQueue(parkingLot *parking, int type, void *owner, int *index) {
+    vehicleLot *lot = &parking->vehicles[type];
+    lockLot(parking, type, 0);
+    semWait(&lot->queueLock, SEM_QUEUE_LOCK(type));
+    *index = -1;
+    // A spot released before the lock was taken is reserved here, after it only the queue gets spots
+    if (!takeSpot(&lot->waitingQueue)) {
+        *index = lot->unusedSlot;
+        waitSlot *slot = &lot->slots[*index];
+        lot->unusedSlot = slot->next;
+        slot->granted = 0;
+        slot->owner = owner;
+        slot->next = -1;
+        slot->prev = lot->queueTail;
+        if (lot->queueTail == -1) {
+            lot->queueHead = *index;
+        } else {
+            lot->slots[lot->queueTail].next = *index;
+        }
+        lot->queueTail = *index;
+        lot->queueLength++;
+    }
+    semPost(&lot->queueLock, SEM_QUEUE_LOCK(type));
+    unlockLot(parking, type, 0);
+    return *index != -1;
+}
+
+// Owner leaves the waiting queue at its deadline. Returns WAIT_GRANTED if the spot was handed over first
+int leaveQueue(parkingLot *parking, int type, int index) {
+    vehicleLot *lot = &parking->vehicles[type];
+    waitSlot *slot = &lot->slots[index];
+    int result = WAIT_GRANTED;
+    semWait(&lot->queueLock, SEM_QUEUE_LOCK(type));
+    if (!slot->granted) {
+        result = WAIT_TIMEOUT;
+        lot->queueLength--;
+        if (slot->prev == -1) {
+            lot->queueHead = slot->next;
+        } else {
+            lot->slots[slot->prev].next = slot->next;
+        }
+        if (slot->next == -1) {
+            lot->queueTail = slot->prev;
+        } else {
+            lot->slots[slot->next].prev = slot->prev;
+        }
+    }
+    while (semTryWait(&slot->wake, SEM_WAKE(type)) == 0) ; // A grant that raced with the timeout leaves a post behind
+    slot->next = lot->unusedSlot;
+    lot->unusedSlot = index;
+    semPost(&lot->queueLock, SEM_QUEUE_LOCK(type));
+    return result;
+}
+
+// Owner waits in the queue until a regular spot is handed over or the seconds pass
+int ownerWaits(parkingLot *parking, int type, int seconds) {
+    struct timespec deadline;
+    int index;
+    if (!joinQueue(parking, type, NULL, &index)) {
+        return WAIT_GRANTED;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    while (semTimedWait(&parking->vehicles[type].slots[index].wake, &deadline, SEM_WAKE(type)) == -1 && errno == EINTR) ;
+    return leaveQueue(parking, type, index);
+}
+
+// Choose the first lot to try for a vehicle
+int routeVehicle(long id, int type) {
+    if (routePolicy == ROUTE_LEAST_LOADED) {
+        int best = 0;
+        for (int i = 1; i < lotCount; i++) {
+            if (atomic_load_explicit(&parkingLots[i].vehicles[type].freeSpots, memory_order_relaxed) >
+                    atomic_load_explicit(&parkingLots[best].vehicles[type].freeSpots, memory_order_relaxed)) {
+                best = i;
+            }
+        }
+        return best;
+    }
+    return (unsigned long)id * 2654435761UL % lotCount; // Multiplicative hash spreads consecutive ids
+}
+
+// Owner arrives at the routed lot and spills over to the next lots while their free parking is full
+int parkVehicle(long id, int type, parkingLot **parked) {
+    int first = routeVehicle(id, type);
+    for (int i = 0; i < lotCount; i++) {
+        parkingLot *lot = &parkingLots[(first + i) % lotCount];
+        int result = ownerArrives(lot, type);
+        if (result != NO_FREE_SPACE) {
+            *parked = lot;
+            return result;
+        }
+    }
+    if (printEvents) {
+        printf("No space for another %s in free parking.\n", parkingLots[0].vehicles[type].noun);
+    }
+    *parked = NULL;
+    return NO_FREE_SPACE;
+}